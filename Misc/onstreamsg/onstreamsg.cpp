@@ -44,6 +44,55 @@
   Changes
   =======
 
+  0.9.14Beta 2026/10/19	Use the SG_IO interface if the sg driver has it; frames are
+			transferred straight to/from the caller's buffer. The
+			sg_header write()/read() protocol is kept as fallback
+			(or set OSG_NO_SGIO in the environment to force it).
+			Queued mode (-q depth): keep several frame READs/WRITEs
+			outstanding on the sg fd, completions matched by pack_id.
+			Pipeline mode (-p frames): file I/O runs in its own thread,
+			feeding/draining the tape loop through a frame queue.
+			WaitForWrite() sleeps according to the measured drain rate
+			of the drive buffer instead of a fixed second.
+			Catalog (-c) of the files on tape into an index file (-x),
+			from the header filemark table or a scan of the tape, and
+			restore of a single file (-F) located via the index.
+			Only sample the drive buffer status every 16 frames while
+			writing; in between, free frames that must be on tape.
+			Check the debug level before formatting messages, leave the
+			trace levels out of release builds, and add a binary trace
+			of all SCSI commands (-T) with a decoder (-D).
+			Benchmark mode (-b) for throughput, latencies, drive buffer
+			fill and error recoveries. A tape image file can stand in
+			for the drive (-E), with OSG_EMU_RATE (MB/s) and
+			OSG_EMU_WRITE_ERROR (fail every n-th write) to taste.
+			Restore to a pipe with vmsplice(), and to a file with
+			preallocated direct writes of 32 frames (-S: stdio).
+			Read error recovery goes by the frame sequence numbers:
+			bounded forward probing and bisection back (as the osst
+			driver's get_logical_frame), EOD frames of earlier write
+			passes are skipped, and lost frames are reported.
+			Write checkpoints (-k): the frames known on tape and the
+			input offset are saved every 256 frames and on a signal;
+			-R checks the tape against them and goes on from there.
+			Stripe sets: with a list of drives (-n 0,1 or -E a,b) the
+			stream is striped frame by frame over them, a process per
+			drive; data frames carry set id and stripe number in their
+			DriverUnique bytes, by which reading puts it back together.
+			Tape copy (-C source): frames of the source's last write
+			pass go through a ring to the target, read in their own
+			thread, with write pass, sequence number and frame addresses
+			stamped anew; the target header gets EOD and filemarks.
+			Compression (-z threads): 128 KB blocks are deflated by a
+			pool of threads and packed into full frames, flagged 0x20
+			in the DAT; reads inflate them. Needs zlib (ZLIB=yes).
+			Append (-a): go on at the EOD the header frames point to,
+			with a filemark before the new file. All writes now keep
+			EOD and filemarks in the header; -c lists the file after
+			the last filemark too.
+			-E takes the indexed images of os_dump -c as well; they
+			are mapped read-only, and frames that were unreadable
+			when dumped fail to read.
   0.9.13Beta 2000/3/03	Use polling mode only if needed, because of buggy firmware.
   0.9.12Beta 2000/3/01  Changed skip on read to 40.
 	(KG)		Check for Firmware and save revision
@@ -127,13 +176,22 @@
 #include <time.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <pthread.h>
+#include <poll.h>
 
 #include <netinet/in.h>
 
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 
 #include <linux/version.h>
 
@@ -149,10 +207,109 @@
 #define SG_GET_RESERVED_SIZE 0x2272
 #define SG_GET_SG_TABLESIZE  0x227F
 #define SG_SET_COMMAND_Q     0x2271 
+#define SG_GET_VERSION_NUM   0x2282
+#define SG_IO                0x2285
+#define SG_SET_FORCE_PACK_ID 0x227b
+/* First sg driver version with the sg_io_hdr interface */
+#define SG_IO_MIN_VERSION    30000
 
-#define VERSION "0.9.13Beta"
+#define VERSION "0.9.14Beta"
 #define VENDORID "LINX"
 
+/* Most READ/WRITE commands we keep outstanding in queued mode (-q) */
+#define MAX_QUEUE_DEPTH 32
+
+/* Sample the drive buffer status every this many frames written, or
+ * when this many frames are held for a possible requeue */
+#define BUFFER_SAMPLE_FRAMES 16
+#define SHADOW_MAX_FRAMES   128
+
+/* Save the write checkpoint (-k) every this many frames on tape */
+#define CHECKPOINT_FRAMES   256
+
+/* Bounds (us) for polling the drive buffer while it drains */
+#define DRAIN_POLL_MIN   20000
+#define DRAIN_POLL_MAX 1000000
+
+/* Highest debug level compiled in. Release builds (DEBUG=no in the
+ * Makefile) leave out the per-frame and per-command messages */
+#ifndef OSG_MAX_DEBUG
+#ifdef DEBUG
+#define OSG_MAX_DEBUG 10
+#else
+#define OSG_MAX_DEBUG 3
+#endif
+#endif
+
+/* The level is checked before anything gets formatted */
+#define Debug(level, ...) \
+	do { \
+		if ((level) <= OSG_MAX_DEBUG && debug >= (level)) \
+			DebugPrint(__VA_ARGS__); \
+	} while (0)
+
+/* Binary command trace (-T) */
+#define TRACE_MAGIC "OSGTRC1\n"
+
+/* Read error recovery (FindLogicalFrame): at most RECOVER_MAX_PROBES
+ * locates, steps over useless frames growing to RECOVER_MAX_STEP, no
+ * further than RECOVER_MAX_AHEAD frames past the last good frame.
+ * Brackets narrower than RECOVER_SCAN frames are read through. */
+#define RECOVER_MAX_PROBES   48
+#define RECOVER_MAX_STEP     80
+#define RECOVER_MAX_AHEAD  4000
+#define RECOVER_SCAN         96
+
+/* Restore output (see OutputOpen): slots hold a frame's data page
+ * aligned, direct writes go out OUTPUT_BATCH frames at a time */
+#define OUTPUT_SLOT     36864
+#define OUTPUT_BATCH       32
+#define OUTPUT_PIPE    524288
+#define OUTPUT_PREALLOC (64 << 20)
+
+/* Stripe sets (-n/-E with a list of drives): at most MAX_STRIPES
+ * drives, each fed through a pipe of STRIPE_PIPE bytes. Data frames
+ * carry STRIPE_MAGIC, set id, stripe number and count (STRIPE_ID) at
+ * the start of their DriverUnique bytes. */
+#define MAX_STRIPES         8
+#define STRIPE_PIPE   1048576
+#define STRIPE_MAGIC   "OSGS"
+
+/* Compression (-z): input is compressed in blocks of COMPRESS_BLOCK
+ * bytes, each stored behind a COMPRESS_HEADER byte header (stored
+ * length, COMPRESS_RAW if it did not shrink, and original length), and
+ * the blocks are packed into frames flagged DAT_COMPRESSED. Bytes 16-23
+ * of their DriverUnique hold COMPRESS_MAGIC and where in the frame the
+ * first block starts (COMPRESS_NOSYNC if none does), so a restore can
+ * pick up the blocks again after lost frames. */
+#define COMPRESS_BLOCK   131072
+#define COMPRESS_HEADER  8
+#define COMPRESS_RAW     0x80000000
+#define COMPRESS_MAGIC   "OSGZ"
+#define COMPRESS_NOSYNC  0xFFFFFFFF
+#define COMPRESS_LEVEL   6
+#define MAX_COMPRESS_THREADS 16
+#define DAT_COMPRESSED   0x20
+
+/* Tape copy (-C): frames in the ring between the drives, unless set
+ * with -p, and entries in the header filemark table */
+#define COPY_RING         256
+#define FM_TAB_MAX       1024
+
+/* How often (ms) a thread waiting for input looks up to see if it
+ * should stop */
+#define INPUT_POLL        100
+
+/* Frames the emulated drive (-E) buffers when its speed is limited */
+#define EMU_BUFFER_FRAMES 64
+
+/* Indexed tape images (os_dump -c, laid out as in sg_utils/os_image.h):
+ * a header page, the frames, a bit per frame set if it was unreadable
+ * and an index of the header, filemark and EOD frames; big endian */
+#define IMG_MAGIC         "OSTIMAGE"
+#define IMG_ALIGN         4096
+#define IMG_FRAME         33280
+
 const ssize_t cbSGHeader = sizeof(sg_header);
 
 //***********************************************
@@ -160,8 +317,24 @@ const ssize_t cbSGHeader = sizeof(sg_header);
 //***********************************************
 int debug = 0;
 FILE* fDebugFile = NULL;
+FILE* fTraceFile = NULL;
+struct timeval TraceStart;
 volatile int signalled = 0;
 unsigned int TotalBufferedFrames = 0;
+/* Frames given to the drive since the buffer status was last sampled,
+ * frames freed since then because the drive must have written them, and
+ * (queued mode) frames the drive refused after a write error */
+unsigned int UncheckedFrames = 0;
+unsigned int InferredFrames = 0;
+unsigned int RejectedFrames = 0;
+/* Size of the drive buffer in frames, 0 until sampled */
+unsigned int DriveBufferFrames = 0;
+/* Threads compressing the input, 0: no compression */
+unsigned int CompressThreads = 0;
+/* Stripe set being written: its id, size and the stripe of this process */
+unsigned int StripeSetID = 0;
+unsigned int nStripes = 1;
+unsigned int StripeNo = 0;
 const char* szOnStreamErrors[] = {
 	"no error",
 	"device never became ready for writing",
@@ -220,6 +393,32 @@ struct TAPE_PARAMETERS {
 	UINT16 Trks;
 };
 
+/* A READ or WRITE submitted to sg and not yet reaped */
+struct SG_QUEUE_ENTRY {
+	sg_io_hdr_t io;
+	UINT8  CDB[6];
+	UINT8  Sense[16];
+	UINT32 Tag;
+	struct timeval Start;
+};
+
+/* One SCSI command in the binary trace (-T), host byte order.
+ * Times are in us, Start relative to when the trace was opened. */
+struct TRACE_RECORD {
+	unsigned int  StartSec;
+	unsigned int  StartUsec;
+	unsigned int  Duration;
+	unsigned int  Length;
+	unsigned int  PackID;
+	unsigned char CDB[10];
+	unsigned char CDBLength;
+	unsigned char Status;    // 0 ok, 1 failed
+	unsigned char SenseKey;
+	unsigned char ASC;
+	unsigned char ASCQ;
+	unsigned char Queued;
+};
+
 struct TAPEBUFFER {
 	unsigned char *Frame;
 	TAPEBUFFER *Next;
@@ -256,6 +455,100 @@ struct AUX_FRAME {
 	unsigned char DriverUnique[32];
 } __attribute__ ((packed));
 
+/* Ring of frame buffers with READs outstanding in queued mode */
+struct READAHEAD {
+	unsigned char *Frames;
+	unsigned int   nNext;
+};
+
+/* Where restored data goes. To a pipe the frames are vmsplice()d, to
+ * a file they are written with O_DIRECT; anything else gets stdio.
+ * Pages given to a pipe may be spliced on by the reader and referenced
+ * for long after, so each frame gets pages of its own, never reused. */
+enum OutputMode {
+	omStdio,
+	omPipe,
+	omDirect,
+	omFile,
+};
+
+struct OUTPUT {
+	OutputMode     Mode;
+	FILE          *File;
+	int            fd;
+	int            fdCaller;	/* fd of File; fd is our own for direct I/O */
+	unsigned char *Slots;
+	unsigned int   nSlots;
+	unsigned int   nNext;
+	unsigned char *Fresh;	/* pipe: the pages for the next frame */
+	struct iovec   Pending[OUTPUT_BATCH];
+	unsigned int   nPending;
+	off_t          Offset;	/* file position of the next write */
+	off_t          Allocated;	/* preallocated up to here */
+	bool           fPrealloc;
+};
+
+/* Bounded single producer/single consumer queue of frames between the
+ * tape and a thread doing the file I/O (-p). Slots are 33280 bytes, so a
+ * frame can be formatted and sent to the drive in place. */
+struct COPYSOURCE;
+
+struct FRAMEQUEUE {
+	unsigned char *Frames;
+	unsigned int  *Sizes;
+	unsigned int  *Syncs;	/* -z: where the first block starts in each */
+	unsigned int   nSlots;
+	unsigned int   nHead;	/* frames taken by the consumer */
+	unsigned int   nTail;	/* frames published by the producer */
+	int            fDone;	/* producer will not publish any more */
+	FILE          *File;
+	OUTPUT        *Output;	/* used instead of File, if set */
+	COPYSOURCE    *Source;	/* CopyThread: the drive to copy from */
+	unsigned long long nBytes;
+};
+
+/* Logical frames a restore could not find */
+struct LOSTFRAMES {
+	unsigned long nFrames;
+	unsigned int  nRanges;
+	bool          fGaveUp;	/* the rest, if any */
+};
+
+/* One file on tape, as found by -c. EndSeq and EndLBA are the values
+ * following the last data frame of the file. */
+struct CATALOG_ENTRY {
+	UINT32 FirstFrame;
+	UINT32 LastFrame;
+	unsigned long FirstSeq;
+	unsigned long EndSeq;
+	unsigned long long FirstLBA;
+	unsigned long long EndLBA;
+};
+
+struct CATALOG {
+	unsigned int   WritePass;
+	unsigned int   nEntries;
+	CATALOG_ENTRY *Entries;
+};
+
+/* Write progress as saved by -k, to go on from with -R */
+struct CHECKPOINT {
+	unsigned int       WritePass;
+	unsigned long      nFrames;	/* data frames on tape, 0: none yet */
+	UINT32             Frame;	/* where the last of them is */
+	unsigned long long LBA;		/* and its logical block address */
+	unsigned long long Offset;	/* input bytes on tape */
+};
+
+/* What a drive process of a stripe set reads from its tape and sends
+ * ahead of the data */
+struct STRIPE_ID {
+	char         Magic[4];
+	unsigned int SetID;
+	unsigned int Stripe;
+	unsigned int nStripes;
+};
+
 struct TAPEBUFFER *TapeBuffer = NULL;
 
 static char strbuf[128];
@@ -273,10 +566,10 @@ char* truncstring (char* buf, int len)
 class OnStream {
 public:
 	OnStream();
-	OnStream(const char* szDevice);
+	OnStream(const char* szDevice, bool fImage = false, bool fReadOnly = false);
 	~OnStream();
 
-	bool OpenDevice(const char* szDevice);
+	bool OpenDevice(const char* szDevice, bool fImage = false, bool fReadOnly = false);
 	bool CloseDevice(void);
 
 	bool StartRead(void);
@@ -306,6 +599,13 @@ public:
 	bool LURetentionAndEject(void);
 	bool IsOnstream(void);
 
+	unsigned int SetQueueDepth(unsigned int depth);
+	unsigned int QueueDepth(void);
+	unsigned int Outstanding(void);
+	bool QueueWrite(void* pBuffer, unsigned int len, UINT32 tag);
+	bool QueueRead(void* pBuffer, UINT32 tag);
+	bool Complete(UINT32* tag);
+
 	bool TestUnitReady(void);
 
 	bool ShowPosition(unsigned int *, unsigned int *);
@@ -317,9 +617,12 @@ public:
 	
 	OnStreamError GetLastError(void);
 	UINT32 FWRev(void);
+	bool UsingSGIO(void);
+	bool Emulated(void);
 
 private:
 	sg_header SG;
+	bool          fSGIO;
 
 	UINT8*        pCommandBuffer;
 	UINT8*        pResultBuffer;
@@ -329,9 +632,34 @@ private:
 	ssize_t       cbTempBuffer;
 	UINT8         pLastSense[16];
 
+	/* Caller supplied data buffer for the next command (frames) */
+	UINT8*        pUserBuffer;
+	ssize_t       cbUserBuffer;
+	bool          fUserToDevice;
+
 	UINT32        nPacketID;
 	UINT32	      Firmware;
 
+	SG_QUEUE_ENTRY Queue[MAX_QUEUE_DEPTH];
+	unsigned int  nQueueHead;
+	unsigned int  nQueued;
+	unsigned int  nQueueDepth;
+
+	/* File backed emulated drive (-E): frames are stored 33280 bytes
+	 * apiece at frame * 33280 */
+	bool          fEmulated;
+	UINT32        nEmuPosition;
+	double        dEmuRate;	/* frames/s the tape moves, 0: no limit */
+	double        dEmuBusy;	/* when the tape will have caught up */
+	unsigned int  nEmuWrites;
+	unsigned int  nEmuWriteError;	/* fail every n-th WRITE, 0: never */
+	bool          fEmuWriteFault;	/* WRITEs fail until the next LOCATE */
+	/* An indexed image is mapped here, and read only */
+	UINT8*        pEmuImage;
+	size_t        cbEmuImage;
+	UINT32        nEmuFirst;
+	UINT32        nEmuFrames;
+
 	int           nFD;
 	OnStreamError LastError;
 
@@ -339,6 +667,15 @@ private:
 	bool WaitForWrite(const int nSec = 90, const int nUsec = 0);
 	bool WaitForRead(const int nSec = 90, const int nUsec = 0);
 	bool SCSICommand(const int nSec = 90, const int nUsec = 0);
+	bool SGHeaderCommand(const int nSec, const int nUsec);
+	bool SGIOCommand(const int nSec, const int nUsec);
+	bool EmulatedCommand(void);
+	bool Emulate(const UINT8* pCDB, UINT8* pData, ssize_t cbData, UINT8* pSense);
+	bool MapImage(const char* szDeviceName, off_t cbFile);
+	unsigned int EmuBuffered(void);
+	void UserBuffer(void* pBuffer, ssize_t nBytes, bool fToDevice);
+	bool QueueCommand(UINT8 opcode, void* pBuffer, unsigned int len, bool fToDevice, UINT32 tag);
+	int CDBLength(UINT8 opcode);
 
 	void NeedCommandBytes(ssize_t nBytes);
 	void NeedResultBytes(ssize_t nBytes);
@@ -368,7 +705,11 @@ void WaitForReady(OnStream* , bool = false);
 // Function definitions
 //***********************************************
 
-void Debug(const int nDebugLevel, const char *format, ...);
+void DebugPrint(const char *format, ...);
+void TraceCommand(const UINT8* pCDB, int cbCDB, const struct timeval* pStart, 
+		  unsigned int nBytes, UINT32 nPackID, bool fOK, 
+		  const UINT8* pSense, bool fQueued);
+bool ReadFrameAt(OnStream *pOnStream, UINT32 nFrame, unsigned char *buf, AUX_FRAME *pAux);
 
 void cpAndSwap(void *dest, void *source, unsigned int width) 
 {
@@ -423,7 +764,7 @@ void FormatAuxFrame(struct AUX_FRAME AuxFrame, unsigned char* FAuxFrame)
 void unFormatAuxFrame(unsigned char* FAuxFrame, struct AUX_FRAME *AuxFrame) {
 	unsigned int counter;
 
-	memset(AuxFrame, 0, sizeof(AuxFrame));
+	memset(AuxFrame, 0, sizeof(*AuxFrame));
 	if (FAuxFrame[0] != '\0' || FAuxFrame[1] != '\0' || FAuxFrame[2] != '\0' 
 	 || FAuxFrame[3] != '\0')
 		return;
@@ -458,8 +799,26 @@ OnStream::OnStream()
 	pResultBuffer   = NULL;
 	cbTempBuffer    = 0;
 	pTempBuffer     = NULL;
+	pUserBuffer     = NULL;
+	cbUserBuffer    = 0;
+	fUserToDevice   = false;
 	nPacketID       = 1;
 	nFD             = -1;
+	fSGIO           = false;
+	nQueueHead      = 0;
+	nQueued         = 0;
+	nQueueDepth     = 1;
+	fEmulated       = false;
+	nEmuPosition    = 0;
+	dEmuRate        = 0;
+	dEmuBusy        = 0;
+	nEmuWrites      = 0;
+	nEmuWriteError  = 0;
+	fEmuWriteFault  = false;
+	pEmuImage       = NULL;
+	cbEmuImage      = 0;
+	nEmuFirst       = 0;
+	nEmuFrames      = 0;
 	Firmware	= 0;
 	LastError       = oseNoError;
 
@@ -467,7 +826,7 @@ OnStream::OnStream()
 
 }
 
-OnStream::OnStream(const char* szDevice) 
+OnStream::OnStream(const char* szDevice, bool fImage, bool fReadOnly) 
 {
 	cbCommandBuffer = 0;
 	pCommandBuffer  = NULL;
@@ -475,12 +834,31 @@ OnStream::OnStream(const char* szDevice)
 	pResultBuffer   = NULL;
 	cbTempBuffer    = 0;
 	pTempBuffer     = NULL;
+	pUserBuffer     = NULL;
+	cbUserBuffer    = 0;
+	fUserToDevice   = false;
 	nPacketID       = 1;
 	nFD             = -1;
+	fSGIO           = false;
+	nQueueHead      = 0;
+	nQueued         = 0;
+	nQueueDepth     = 1;
+	fEmulated       = false;
+	nEmuPosition    = 0;
+	dEmuRate        = 0;
+	dEmuBusy        = 0;
+	nEmuWrites      = 0;
+	nEmuWriteError  = 0;
+	fEmuWriteFault  = false;
+	pEmuImage       = NULL;
+	cbEmuImage      = 0;
+	nEmuFirst       = 0;
+	nEmuFrames      = 0;
+	Firmware	= 0;
 	LastError       = oseNoError;
 
 	memset(&SG, 0, cbSGHeader);
-	if (!OpenDevice(szDevice)) {
+	if (!OpenDevice(szDevice, fImage, fReadOnly)) {
 		Debug(0, "OnStream::OnStream: open: Failed - %s (%d)\n", strerror(errno), errno);
 		exit(-1);
 	}
@@ -506,6 +884,16 @@ inline UINT32 OnStream::FWRev(void)
 	return Firmware;
 }
 
+bool OnStream::UsingSGIO(void) 
+{
+	return fSGIO;
+}
+
+bool OnStream::Emulated(void) 
+{
+	return fEmulated;
+}
+
 void OnStream::NeedCommandBytes(ssize_t nBytes) 
 {
 	void* pTemp;
@@ -583,14 +971,120 @@ OnStreamError OnStream::GetLastError(void)
 	return LastError;
 }
 
-bool OnStream::OpenDevice(const char* szDeviceName) 
+bool OnStream::OpenDevice(const char* szDeviceName, bool fImage, bool fReadOnly) 
+{
+	int nVersion = 0;
+	struct stat st;
+
+	/* An image only read from (the source of a copy) must exist */
+	if (fImage && fReadOnly)
+		nFD = open(szDeviceName, O_RDONLY);
+	else
+		nFD = open(szDeviceName, fImage ? O_RDWR | O_CREAT : O_RDWR, 0644);
+	if (-1 == nFD && fImage && !fReadOnly && (EACCES == errno || EROFS == errno)) {
+		/* A read-only image can still be read from */
+		nFD = open(szDeviceName, O_RDONLY);
+		if (-1 != nFD)
+			Debug(1, "%s is read-only\n", szDeviceName);
+	}
+	if (-1 == nFD)
+		return false;
+	if (fstat(nFD, &st) < 0 || (fImage ? !S_ISREG(st.st_mode) : !S_ISCHR(st.st_mode))) {
+		/* Never mistake a missing device node for an image */
+		close(nFD);
+		nFD = -1;
+		errno = fImage ? EINVAL : ENODEV;
+		return false;
+	}
+
+	/* The tape image (-E) is a plain file. Its speed and write errors
+	 * can be set from the environment. */
+	if (fImage) {
+		fEmulated = true;
+		if (getenv("OSG_EMU_RATE"))
+			dEmuRate = atof(getenv("OSG_EMU_RATE")) * 1048576.0 / 32768;
+		if (getenv("OSG_EMU_WRITE_ERROR"))
+			nEmuWriteError = atoi(getenv("OSG_EMU_WRITE_ERROR"));
+		Debug(2, "Emulating a drive in %s, %.0f frames/s\n", szDeviceName, dEmuRate);
+		return MapImage(szDeviceName, st.st_size);
+	}
+
+	/* sg >= 3.0 can move frames straight to/from our buffers (SG_IO),
+	 * older drivers only know the sg_header write()/read() protocol */
+	if (ioctl(nFD, SG_GET_VERSION_NUM, &nVersion) == 0 && nVersion >= SG_IO_MIN_VERSION)
+		fSGIO = true;
+	if (getenv("OSG_NO_SGIO"))
+		fSGIO = false;
+	Debug(2, "sg driver version %d, using %s interface\n", nVersion,
+	      fSGIO ? "SG_IO" : "sg_header");
+	return true;
+}
+
+//***********************************************
+// BE32: a big endian 32 bit number, wherever it lies
+static UINT32 BE32(const UINT8* p)
+{
+	return ((UINT32) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+//***********************************************
+// PutBE32: store a 32 bit number big endian, touching only its 4 bytes
+static void PutBE32(UINT8* p, UINT32 n)
+{
+	p[0] = n >> 24;
+	p[1] = n >> 16;
+	p[2] = n >> 8;
+	p[3] = n;
+}
+
+//***********************************************
+// MapImage: if the emulated drive's file is an indexed image, map it
+// Inputs:  its name and size
+// Outputs: false if it is a broken image
+bool OnStream::MapImage(const char* szDeviceName, off_t cbFile) 
 {
-	nFD = open(szDeviceName, O_RDWR);
-	return (-1 != nFD);
+	UINT8 hdr[24];
+	UINT32 nCount, i, nType, nHeaders = 0, nMarks = 0, nEOD = 0;
+	off_t nIndex;
+	UINT8* pEntry;
+
+	if (pread(nFD, hdr, sizeof(hdr), 0) != sizeof(hdr) || memcmp(hdr, IMG_MAGIC, 8))
+		return true;
+	nEmuFirst  = BE32(&hdr[16]);
+	nEmuFrames = BE32(&hdr[20]);
+	nIndex = IMG_ALIGN + (off_t) nEmuFrames * IMG_FRAME + ((nEmuFrames + 63) / 64) * 8;
+	if (1 != BE32(&hdr[8]) || IMG_FRAME != BE32(&hdr[12])
+	    || cbFile < nIndex + 8) {
+		Debug(0, "%s: unknown or truncated image\n", szDeviceName);
+		errno = EINVAL;
+		return false;
+	}
+	pEmuImage = (UINT8*) mmap(NULL, cbFile, PROT_READ, MAP_SHARED, nFD, 0);
+	if (MAP_FAILED == pEmuImage) {
+		pEmuImage = NULL;
+		return false;
+	}
+	cbEmuImage = cbFile;
+	nCount = BE32(&pEmuImage[nIndex]);
+	for (i = 0; i < nCount && nIndex + 8 + (off_t) (i + 1) * 16 <= cbFile; i++) {
+		pEntry = &pEmuImage[nIndex + 8 + i * 16];
+		nType = BE32(&pEntry[4]);
+		if (1 == nType)
+			nHeaders++;
+		else if (2 == nType)
+			nMarks++;
+		else if (3 == nType)
+			nEOD = BE32(pEntry);
+	}
+	Debug(1, "Image of %u frames from %u: %u header frames, %u filemarks, EOD at %u\n",
+	      nEmuFrames, nEmuFirst, nHeaders, nMarks, nEOD);
+	return true;
 }
 
 bool OnStream::CloseDevice(void) 
 {
+	if (NULL != pEmuImage)
+		munmap(pEmuImage, cbEmuImage);
 	if (-1 != nFD)
 		close(nFD);
 
@@ -701,7 +1195,7 @@ bool OnStream::IsOnstream(void)
 bool OnStream::Read(void* pBuffer) 
 {
 	NeedCommandBytes(6);
-	NeedResultBytes(33280);
+	NeedResultBytes(0);
 
 	pCommandBuffer[0] = 0x08; // READ
 	pCommandBuffer[1] = 0x01; // 7-2: reserved; 1: SILI; 0: Fixed
@@ -710,11 +1204,9 @@ bool OnStream::Read(void* pBuffer)
 	pCommandBuffer[4] = 0x01; // Transfer length, 7-0
 	pCommandBuffer[5] = 0x00; // reserved
 
-	if (false == SCSICommand())
-		return false;
-
-	memmove(pBuffer, pResultBuffer, 33280);
-	return true;
+	/* The frame goes straight into the caller's buffer */
+	UserBuffer(pBuffer, 33280, false);
+	return SCSICommand();
 }
 
 void OnStream::GetLastSense(void *sense) 
@@ -942,7 +1434,7 @@ bool OnStream::Write(void* pBuffer, unsigned int len)
 	if (len != 32768 && len != 33280 && len != 0)
 		return false;
 	
-	NeedCommandBytes(6 + len);
+	NeedCommandBytes(6);
 	NeedResultBytes(0);
 
 	pCommandBuffer[0] = 0x0A; // WRITE
@@ -956,7 +1448,7 @@ bool OnStream::Write(void* pBuffer, unsigned int len)
 
 	pCommandBuffer[5] = 0x00; // reserved;
 	if (pBuffer != NULL)
-		memmove(&pCommandBuffer[6], pBuffer, len);
+		UserBuffer(pBuffer, len, true);
 
 	return SCSICommand();
 }
@@ -1237,20 +1729,362 @@ void signalHandler(int sig)
 //          otherwise   number of bytes read (not counting sg_header)
 //          false if an error occured
 bool OnStream::SCSICommand(const int nSec, const int nUsec) 
+{
+	bool rc;
+	struct timeval start;
+	UINT8 CDB[10];
+	int cbCDB = 0;
+	unsigned int nBytes = 0;
+
+	if (NULL != fTraceFile) {
+		gettimeofday(&start, NULL);
+		cbCDB = min(CDBLength(pCommandBuffer[0]), (int) sizeof(CDB));
+		memcpy(CDB, pCommandBuffer, cbCDB);
+		if (NULL != pUserBuffer)
+			nBytes = cbUserBuffer;
+		else
+			nBytes = max(cbResultBuffer, cbCommandBuffer - cbCDB);
+	}
+
+	if (fEmulated)
+		rc = EmulatedCommand();
+	else if (fSGIO)
+		rc = SGIOCommand(nSec, nUsec);
+	else
+		rc = SGHeaderCommand(nSec, nUsec);
+
+	if (NULL != fTraceFile)
+		TraceCommand(CDB, cbCDB, &start, nBytes, nPacketID - 1, rc, pLastSense, false);
+
+	UserBuffer(NULL, 0, false);
+	return rc;
+}
+
+//***********************************************
+// UserBuffer: set the data buffer for the next SCSI command
+// Inputs:  buffer, its length and the direction of the transfer
+// Note:    With SG_IO the data moves between the device and this buffer
+//          without passing through pCommandBuffer/pResultBuffer.
+void OnStream::UserBuffer(void* pBuffer, ssize_t nBytes, bool fToDevice) 
+{
+	pUserBuffer   = (UINT8*) pBuffer;
+	cbUserBuffer  = nBytes;
+	fUserToDevice = fToDevice;
+}
+
+//***********************************************
+// CDBLength: length of the command descriptor block for an opcode
+// (the sg driver does the same when it splits a sg_header request)
+int OnStream::CDBLength(UINT8 opcode) 
+{
+	switch (opcode >> 5) {
+	case 0:
+		return 6;
+	case 1:
+	case 2:
+		return 10;
+	case 5:
+		return 12;
+	default:
+		return min((ssize_t) 16, cbCommandBuffer);
+	}
+}
+
+//***********************************************
+// SGIOCommand: pass a SCSI command to the device through the SG_IO ioctl
+// Inputs:  timeout
+// Outputs: true if the command was passed to the device (check the sense!)
+//          false if the sg driver failed
+// Any parameter bytes following the CDB in pCommandBuffer (MODE SELECT)
+// are sent as data; a buffer set by UserBuffer() is used in place.
+bool OnStream::SGIOCommand(const int nSec, const int nUsec) 
+{
+	sg_io_hdr_t io;
+	UINT8 sense[16];
+	int cbCDB = CDBLength(pCommandBuffer[0]);
+
+	memset(&io, 0, sizeof(io));
+	memset(sense, 0, sizeof(sense));
+	io.interface_id    = 'S';
+	io.cmdp            = pCommandBuffer;
+	io.cmd_len         = cbCDB;
+	io.sbp             = sense;
+	io.mx_sb_len       = sizeof(sense);
+	io.timeout         = nSec * 1000 + nUsec / 1000;
+	io.pack_id         = nPacketID++;
+	io.dxfer_direction = SG_DXFER_NONE;
+
+	if (NULL != pUserBuffer && cbUserBuffer > 0) {
+		io.dxfer_direction = fUserToDevice ? SG_DXFER_TO_DEV : SG_DXFER_FROM_DEV;
+		io.dxferp          = pUserBuffer;
+		io.dxfer_len       = cbUserBuffer;
+		io.flags           = SG_FLAG_DIRECT_IO;
+	} else if (cbCommandBuffer > cbCDB) {
+		io.dxfer_direction = SG_DXFER_TO_DEV;
+		io.dxferp          = &pCommandBuffer[cbCDB];
+		io.dxfer_len       = cbCommandBuffer - cbCDB;
+	} else if (cbResultBuffer > 0) {
+		io.dxfer_direction = SG_DXFER_FROM_DEV;
+		io.dxferp          = pResultBuffer;
+		io.dxfer_len       = cbResultBuffer;
+	}
+
+	Debug(7, "SG_IO: command of %d bytes, %d data bytes...", cbCDB, io.dxfer_len);
+	while (ioctl(nFD, SG_IO, &io) < 0) {
+		if (EINTR == errno || EAGAIN == errno)
+			continue;
+		LastError = oseDeviceFail;
+		Debug(0, "SCSICommand: SG_IO failed: %s\n", strerror(errno));
+		return false;
+	}
+	Debug(7, "Done.\n");
+
+	/* Keep the sg_header based accessors (SenseKey() & co.) working */
+	memset(&SG, 0, cbSGHeader);
+	SG.pack_id  = io.pack_id;
+	SG.pack_len = io.dxfer_len - io.resid;
+	SG.result   = (io.host_status || io.driver_status & ~0x08) ? EIO : 0;
+	memcpy(SG.sense_buffer, sense, 16);
+	memcpy(pLastSense, sense, 16);
+
+	if (debug > 6)
+		DumpSCSIResult(&SG, NULL);
+
+	if (SG_DXFER_FROM_DEV == io.dxfer_direction && io.dxferp == pResultBuffer)
+		NeedResultBytes(io.dxfer_len - io.resid);
+	return true;
+}
+
+//***********************************************
+// EmulatedCommand: run the current command against the tape image (-E)
+// and make its result look like one from sg
+bool OnStream::EmulatedCommand(void) 
+{
+	UINT8 sense[16];
+	int cbCDB = CDBLength(pCommandBuffer[0]);
+	bool rc;
+
+	if (NULL != pUserBuffer && cbUserBuffer > 0)
+		rc = Emulate(pCommandBuffer, pUserBuffer, cbUserBuffer, sense);
+	else if (cbCommandBuffer > cbCDB)
+		rc = Emulate(pCommandBuffer, &pCommandBuffer[cbCDB], cbCommandBuffer - cbCDB, sense);
+	else
+		rc = Emulate(pCommandBuffer, pResultBuffer, cbResultBuffer, sense);
+
+	memset(&SG, 0, cbSGHeader);
+	SG.pack_id = nPacketID++;
+	SG.result  = rc ? 0 : EIO;
+	memcpy(SG.sense_buffer, sense, 16);
+	memcpy(pLastSense, sense, 16);
+	if (!rc)
+		LastError = oseDeviceFail;
+	return rc;
+}
+
+static double EmuClock(void) 
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+//***********************************************
+// EmuBuffered: frames the emulated drive still has to put on tape
+unsigned int OnStream::EmuBuffered(void) 
+{
+	double now = EmuClock();
+
+	if (0 == dEmuRate || dEmuBusy <= now)
+		return 0;
+	return (unsigned int) ((dEmuBusy - now) * dEmuRate + 0.999);
+}
+
+//***********************************************
+// Emulate: the part of an OnStream SC-50 that osg uses
+// Inputs:  CDB, data to or from the host and room for the sense
+// Outputs: false if the image could not be accessed
+// Frames go to the image right away. With OSG_EMU_RATE (MB/s) set, the
+// drive buffers up to EMU_BUFFER_FRAMES frames and WRITE blocks when the
+// buffer is full, like the real thing.
+bool OnStream::Emulate(const UINT8* pCDB, UINT8* pData, ssize_t cbData, UINT8* pSense) 
+{
+	UINT32 nFrame;
+	ssize_t rc;
+	double now;
+
+	memset(pSense, 0, 16);
+	switch (pCDB[0]) {
+	case 0x12: // INQUIRY
+		memset(pData, 0, cbData);
+		if (cbData >= 36) {
+			pData[0] = 0x01; // sequential access device
+			memcpy(&pData[8], "OnStreamSC-50           1.06", 28);
+		}
+		break;
+
+	case 0x1A: // MODE SENSE
+		memset(pData, 0, cbData);
+		if (0x2B == (pCDB[2] & 0x3f) && cbData >= 14) {
+			pData[6]  = 0x42;               // density
+			pData[10] = 19239 >> 8;         // segments per track
+			pData[11] = 19239 & 0xff;
+			pData[13] = 24;                 // tracks
+		} else if (0x33 == (pCDB[2] & 0x3f) && cbData >= 8) {
+			pData[6] = EMU_BUFFER_FRAMES;
+			pData[7] = EmuBuffered();
+		}
+		break;
+
+	case 0x34: // READ POSITION
+		memset(pData, 0, cbData);
+		if (cbData >= 20) {
+			if (0 == nEmuPosition)
+				pData[0] = 0x80;        // BOP
+			PutBE32(&pData[4], nEmuPosition);
+			PutBE32(&pData[8], nEmuPosition - EmuBuffered());
+			pData[15] = EmuBuffered();
+		}
+		break;
+
+	case 0x2B: // LOCATE
+		cpAndSwap(&nFrame, (void*) &pCDB[3], 4);
+		nFrame &= 0xffffffff;
+		/* A SKIP locate leaves the buffer alone, others drain it */
+		if (!(pCDB[9] & 0x80) && dEmuBusy > EmuClock())
+			usleep((unsigned long) ((dEmuBusy - EmuClock()) * 1000000));
+		nEmuPosition = nFrame;
+		fEmuWriteFault = false;
+		break;
+
+	case 0x01: // REWIND
+		nEmuPosition = 0;
+		fEmuWriteFault = false;
+		break;
+
+	case 0x0A: // WRITE
+		if (0 == pCDB[4])
+			break;
+		if (NULL != pEmuImage) {
+			pSense[0]  = 0x70;
+			pSense[2]  = 0x07; // DATA PROTECT
+			pSense[7]  = 10;
+			pSense[12] = 0x27; // WRITE PROTECTED
+			break;
+		}
+		/* Like the drive, refuse the WRITEs queued behind a bad one */
+		if (fEmuWriteFault || (nEmuWriteError && 0 == ++nEmuWrites % nEmuWriteError)) {
+			fEmuWriteFault = true;
+			pSense[0]  = 0x70;
+			pSense[2]  = 0x03; // MEDIUM ERROR
+			pSense[7]  = 10;
+			pSense[12] = 0x0C; // WRITE ERROR
+			break;
+		}
+		if (dEmuRate > 0) {
+			now = EmuClock();
+			dEmuBusy = (dEmuBusy > now ? dEmuBusy : now) + 1 / dEmuRate;
+			if (EmuBuffered() > EMU_BUFFER_FRAMES)
+				usleep((unsigned long) ((dEmuBusy - now - EMU_BUFFER_FRAMES / dEmuRate) * 1000000));
+		}
+		rc = pwrite(nFD, pData, cbData, (off_t) nEmuPosition * 33280);
+		if (rc != cbData) {
+			Debug(0, "Emulate: write to image failed: %s\n", strerror(errno));
+			return false;
+		}
+		nEmuPosition++;
+		break;
+
+	case 0x08: // READ
+		if (0 == pCDB[4])
+			break;
+		if (dEmuRate > 0) {
+			now = EmuClock();
+			dEmuBusy = (dEmuBusy > now ? dEmuBusy : now) + 1 / dEmuRate;
+			usleep((unsigned long) ((dEmuBusy - now) * 1000000));
+		}
+		if (NULL != pEmuImage) {
+			nFrame = nEmuPosition - nEmuFirst;
+			if (nEmuPosition < nEmuFirst || nFrame >= nEmuFrames) {
+				pSense[0]  = 0x70;
+				pSense[2]  = 0x08; // BLANK CHECK
+				pSense[7]  = 10;
+				pSense[13] = 0x05; // END OF DATA
+				break;
+			}
+			if (pEmuImage[IMG_ALIGN + (off_t) nEmuFrames * IMG_FRAME + nFrame / 8] & (1 << (nFrame % 8))) {
+				pSense[0]  = 0x70;
+				pSense[2]  = 0x03; // MEDIUM ERROR
+				pSense[7]  = 10;
+				pSense[12] = 0x11; // UNRECOVERED READ ERROR
+				nEmuPosition++;
+				break;
+			}
+			memcpy(pData, &pEmuImage[IMG_ALIGN + (off_t) nFrame * IMG_FRAME],
+			       min(cbData, (ssize_t) IMG_FRAME));
+			nEmuPosition++;
+			break;
+		}
+		rc = pread(nFD, pData, cbData, (off_t) nEmuPosition * 33280);
+		if (rc < 0) {
+			Debug(0, "Emulate: read from image failed: %s\n", strerror(errno));
+			return false;
+		}
+		if (rc < cbData) {
+			pSense[0]  = 0x70;
+			pSense[2]  = 0x08; // BLANK CHECK
+			pSense[7]  = 10;
+			pSense[13] = 0x05; // END OF DATA
+			break;
+		}
+		nEmuPosition++;
+		break;
+
+	case 0x10: // WRITE FILEMARKS, which flushes
+		if (dEmuBusy > EmuClock())
+			usleep((unsigned long) ((dEmuBusy - EmuClock()) * 1000000));
+		break;
+
+	default:
+		/* TEST UNIT READY, MODE SELECT, LOAD/UNLOAD, REQUEST SENSE &c. */
+		if (0x03 == pCDB[0] && cbData >= 16) {
+			memset(pData, 0, cbData);
+			pData[0] = 0x70;
+			pData[7] = 10;
+		}
+		break;
+	}
+	return true;
+}
+
+//***********************************************
+// SGHeaderCommand: the old sg_header write()/read() transport, used when
+// the sg driver does not support SG_IO
+bool OnStream::SGHeaderCommand(const int nSec, const int nUsec) 
 {
 	sg_header* pSG;
 	ssize_t rc;
+	ssize_t cbOut = 0, cbIn = 0;
+
+	if (NULL != pUserBuffer) {
+		if (fUserToDevice)
+			cbOut = cbUserBuffer;
+		else
+			cbIn = cbUserBuffer;
+	}
 
-	NeedTempBytes(cbSGHeader + max(cbCommandBuffer, cbResultBuffer));
+	NeedTempBytes(cbSGHeader + max(cbCommandBuffer + cbOut, cbResultBuffer + cbIn));
 	pSG = (sg_header*) pTempBuffer;
 	memset(pSG, 0, cbSGHeader);
 
 	pSG->pack_id     = nPacketID++;
 	pSG->twelve_byte = (12 == cbCommandBuffer);
 	pSG->result      = 0;
-	pSG->reply_len   = cbSGHeader + cbResultBuffer;
+	pSG->reply_len   = cbSGHeader + cbResultBuffer + cbIn;
 
 	memmove(&pTempBuffer[cbSGHeader], pCommandBuffer, cbCommandBuffer);
+	if (cbOut > 0)
+		memmove(&pTempBuffer[cbSGHeader + cbCommandBuffer], pUserBuffer, cbOut);
 
 	Debug(7, "Waiting for write...");
 	if (false == WaitForWrite(nSec, nUsec)) {
@@ -1258,9 +2092,9 @@ bool OnStream::SCSICommand(const int nSec, const int nUsec)
 		return false;
 	}
 
-	Debug(7, "Sending command of %d bytes...", cbCommandBuffer);
-	rc = write(nFD, pTempBuffer, cbCommandBuffer + cbSGHeader);
-	if (rc < cbSGHeader + cbCommandBuffer) {
+	Debug(7, "Sending command of %d bytes...", cbCommandBuffer + cbOut);
+	rc = write(nFD, pTempBuffer, cbCommandBuffer + cbOut + cbSGHeader);
+	if (rc < cbSGHeader + cbCommandBuffer + cbOut) {
 		LastError = oseDeviceWriteError;
 		fprintf(stderr, "SCSICommand: write failed\n");
 		DumpSCSIResult(pSG, &pTempBuffer[cbSGHeader]);
@@ -1279,8 +2113,8 @@ bool OnStream::SCSICommand(const int nSec, const int nUsec)
 		return false;
 	}
 
-	Debug(7, "Reading %d bytes...", cbResultBuffer);
-	rc = read(nFD, pTempBuffer, cbSGHeader + cbResultBuffer);
+	Debug(7, "Reading %d bytes...", cbResultBuffer + cbIn);
+	rc = read(nFD, pTempBuffer, cbSGHeader + cbResultBuffer + cbIn);
 	Debug(7, "Done.\n");
 	memcpy(pLastSense, pSG->sense_buffer, 16);
 	if (rc < 0) {
@@ -1306,7 +2140,10 @@ bool OnStream::SCSICommand(const int nSec, const int nUsec)
 	if (debug > 6)
 		DumpSCSIResult(pSG, &pTempBuffer[cbSGHeader]);
 
-	if (cbResultBuffer > 0)
+	if (cbIn > 0) {
+		memmove(pUserBuffer, pTempBuffer + cbSGHeader, cbIn);
+		rc -= cbIn;
+	} else if (cbResultBuffer > 0)
 		memmove(pResultBuffer, pTempBuffer + cbSGHeader, pSG->pack_len - cbSGHeader);
 
 	memmove(&SG, pTempBuffer, cbSGHeader);
@@ -1320,6 +2157,154 @@ bool OnStream::SCSICommand(const int nSec, const int nUsec)
 	return true;
 }
 
+//***********************************************
+// SetQueueDepth: allow several READ/WRITE commands to be outstanding
+// Inputs:  wanted number of outstanding commands
+// Outputs: the depth that will be used. This is 1 (no queuing) if the sg
+//          driver is too old for the sg_io_hdr interface.
+unsigned int OnStream::SetQueueDepth(unsigned int depth) 
+{
+	int one = 1;
+
+	nQueueDepth = 1;
+	if (depth <= 1 || !(fSGIO || fEmulated))
+		return nQueueDepth;
+	if (!fEmulated && (ioctl(nFD, SG_SET_COMMAND_Q, &one) < 0 
+			   || ioctl(nFD, SG_SET_FORCE_PACK_ID, &one) < 0)) {
+		Debug(0, "SetQueueDepth: sg refused command queuing: %s\n", strerror(errno));
+		return nQueueDepth;
+	}
+	nQueueDepth = min(depth, (unsigned int) MAX_QUEUE_DEPTH);
+	Debug(2, "Queuing up to %d commands\n", nQueueDepth);
+	return nQueueDepth;
+}
+
+unsigned int OnStream::QueueDepth(void) 
+{
+	return nQueueDepth;
+}
+
+unsigned int OnStream::Outstanding(void) 
+{
+	return nQueued;
+}
+
+//***********************************************
+// QueueCommand: submit a one frame READ or WRITE without waiting for it
+// Inputs:  opcode, frame buffer (must stay valid until Complete()),
+//          transfer direction and a tag returned by Complete()
+// Outputs: true if sg accepted the command
+bool OnStream::QueueCommand(UINT8 opcode, void* pBuffer, unsigned int len, 
+			    bool fToDevice, UINT32 tag) 
+{
+	SG_QUEUE_ENTRY* pEntry;
+
+	if (nQueued >= nQueueDepth) {
+		Debug(0, "QueueCommand: queue full\n");
+		return false;
+	}
+	pEntry = &Queue[(nQueueHead + nQueued) % MAX_QUEUE_DEPTH];
+	memset(pEntry, 0, sizeof(*pEntry));
+
+	pEntry->CDB[0] = opcode;
+	pEntry->CDB[1] = 0x01; // 7-2: reserved; 1: SILI; 0: Fixed
+	pEntry->CDB[4] = len ? 0x01 : 0x00; // Transfer length, 7-0
+	pEntry->Tag    = tag;
+
+	pEntry->io.interface_id    = 'S';
+	pEntry->io.cmdp            = pEntry->CDB;
+	pEntry->io.cmd_len         = 6;
+	pEntry->io.sbp             = pEntry->Sense;
+	pEntry->io.mx_sb_len       = sizeof(pEntry->Sense);
+	pEntry->io.timeout         = 90 * 1000;
+	pEntry->io.pack_id         = nPacketID++;
+	pEntry->io.dxfer_direction = len ? (fToDevice ? SG_DXFER_TO_DEV : SG_DXFER_FROM_DEV) : SG_DXFER_NONE;
+	pEntry->io.dxferp          = pBuffer;
+	pEntry->io.dxfer_len       = len;
+	pEntry->io.flags           = SG_FLAG_DIRECT_IO;
+	pEntry->io.usr_ptr         = pEntry;
+	if (NULL != fTraceFile)
+		gettimeofday(&pEntry->Start, NULL);
+
+	Debug(7, "Queuing command %02x, pack_id %d, tag %ld\n", opcode, pEntry->io.pack_id, tag);
+	if (fEmulated) {
+		/* Done right away, Complete() only hands out the result */
+		pEntry->io.status = Emulate(pEntry->CDB, (UINT8*) pBuffer, len, pEntry->Sense) ? 0 : 0xff;
+		nQueued++;
+		return true;
+	}
+	while (write(nFD, &pEntry->io, sizeof(pEntry->io)) < 0) {
+		if (EINTR == errno)
+			continue;
+		LastError = oseDeviceWriteError;
+		Debug(0, "QueueCommand: write failed: %s\n", strerror(errno));
+		return false;
+	}
+	nQueued++;
+	return true;
+}
+
+bool OnStream::QueueWrite(void* pBuffer, unsigned int len, UINT32 tag) 
+{
+	if (len != 32768 && len != 33280)
+		return false;
+	return QueueCommand(0x0A, pBuffer, len, true, tag);
+}
+
+bool OnStream::QueueRead(void* pBuffer, UINT32 tag) 
+{
+	return QueueCommand(0x08, pBuffer, 33280, false, tag);
+}
+
+//***********************************************
+// Complete: reap the oldest queued command
+// Inputs:  where to store its tag
+// Outputs: true if the command completed (check the sense, which now
+//          belongs to this very command), false if sg failed
+// The drive executes the commands in order, so completions are matched
+// by pack_id, oldest first.
+bool OnStream::Complete(UINT32* tag) 
+{
+	SG_QUEUE_ENTRY* pEntry;
+	sg_io_hdr_t io;
+
+	if (0 == nQueued)
+		return false;
+	pEntry = &Queue[nQueueHead];
+	memcpy(&io, &pEntry->io, sizeof(io));
+
+	while (!fEmulated && read(nFD, &io, sizeof(io)) < 0) {
+		if (EINTR == errno || EAGAIN == errno)
+			continue;
+		LastError = oseDeviceReadError;
+		Debug(0, "Complete: read failed: %s\n", strerror(errno));
+		return false;
+	}
+	if (io.pack_id != pEntry->io.pack_id) {
+		Debug(0, "Complete: got pack_id %d, expected %d\n", io.pack_id, pEntry->io.pack_id);
+		LastError = oseDeviceFail;
+		return false;
+	}
+	nQueueHead = (nQueueHead + 1) % MAX_QUEUE_DEPTH;
+	nQueued--;
+
+	memset(&SG, 0, cbSGHeader);
+	SG.pack_id  = io.pack_id;
+	SG.pack_len = io.dxfer_len - io.resid;
+	SG.result   = (io.host_status || io.driver_status & ~0x08 || 0xff == io.status) ? EIO : 0;
+	memcpy(SG.sense_buffer, pEntry->Sense, 16);
+	memcpy(pLastSense, pEntry->Sense, 16);
+	if (debug > 6)
+		DumpSCSIResult(&SG, NULL);
+	if (NULL != fTraceFile)
+		TraceCommand(pEntry->CDB, 6, &pEntry->Start, pEntry->io.dxfer_len, 
+			     io.pack_id, 0 == SG.result, pEntry->Sense, true);
+
+	if (NULL != tag)
+		*tag = pEntry->Tag;
+	return true;
+}
+
 bool OnStream::ShowPosition(unsigned int *host, unsigned int *tape) 
 {
 	if (!ReadPosition())
@@ -1560,20 +2545,65 @@ bool DeleteFrames(TAPEBUFFER** FirstBuffer, unsigned int EntriesToDelete)
 	return true;
 }
 
+//***********************************************
+// CheckWrittenFrames: ask the drive how many frames it still buffers and
+// free the shadow copies of those it has written to tape
+// Inputs:  frames given to the drive on top of UncheckedFrames, and the
+//          drive buffer count of the last check
 void CheckWrittenFrames(OnStream *pOnStream, TAPEBUFFER** FirstBuffer, 
 			unsigned int addedFrames, unsigned int* previousFrames) 
 {
-	unsigned int MaxBuffer, CurrentBuffer, writtenFrames;
+	unsigned int MaxBuffer, CurrentBuffer, writtenFrames, givenFrames;
 
 	pOnStream->BufferStatus(&MaxBuffer, &CurrentBuffer);
-
-	writtenFrames = *previousFrames - (CurrentBuffer - addedFrames);
+	if (MaxBuffer > 0 && CurrentBuffer <= MaxBuffer)
+		DriveBufferFrames = MaxBuffer;
+
+	givenFrames = *previousFrames + UncheckedFrames - RejectedFrames + addedFrames;
+	if (givenFrames < CurrentBuffer + InferredFrames) {
+		Debug(1, "Drive buffers %d frames, expected no more than %d\n", 
+		      CurrentBuffer, givenFrames - InferredFrames);
+		writtenFrames = 0;
+	} else
+		writtenFrames = givenFrames - CurrentBuffer - InferredFrames;
 	Debug(6, "Current Buffered Frames: %d Deleting: %d\n", TotalBufferedFrames, writtenFrames);
 	if (!DeleteFrames(FirstBuffer, writtenFrames)) {
 		Debug(0, "Internal Frame Buffer/Tape buffer mismatch!\n");
 		//exit(-1);
 	}
 	*previousFrames = CurrentBuffer;
+	UncheckedFrames = 0;
+	InferredFrames = 0;
+}
+
+//***********************************************
+// NoteWrittenFrames: account for frames the drive has accepted without
+// asking it every time. The drive cannot buffer more than
+// DriveBufferFrames, so anything given to it beyond that has reached the
+// tape and its shadow copy can go. The real buffer status is only sampled
+// every BUFFER_SAMPLE_FRAMES frames, or when we hold too many frames.
+void NoteWrittenFrames(OnStream *pOnStream, TAPEBUFFER** FirstBuffer, 
+		       unsigned int addedFrames, unsigned int* previousFrames) 
+{
+	unsigned int givenFrames, writtenFrames;
+
+	UncheckedFrames += addedFrames;
+	if (UncheckedFrames >= BUFFER_SAMPLE_FRAMES || TotalBufferedFrames >= SHADOW_MAX_FRAMES
+	    || 0 == DriveBufferFrames) {
+		CheckWrittenFrames(pOnStream, FirstBuffer, 0, previousFrames);
+		return;
+	}
+
+	givenFrames = *previousFrames + UncheckedFrames - RejectedFrames;
+	if (givenFrames <= DriveBufferFrames + InferredFrames)
+		return;
+	writtenFrames = givenFrames - DriveBufferFrames - InferredFrames;
+	Debug(6, "Inferred %d frames written\n", writtenFrames);
+	if (!DeleteFrames(FirstBuffer, writtenFrames)) {
+		Debug(0, "Internal Frame Buffer/Tape buffer mismatch!\n");
+		return;
+	}
+	InferredFrames += writtenFrames;
 }
 
 bool FlushBuffer(OnStream *pOnStream) 
@@ -1625,7 +2655,9 @@ unsigned int RequeueData(OnStream *pOnStream, TAPEBUFFER** TapeBuffer,
 		BadFrames = skip;
 #endif
 		Debug(3, "Current Frames in tape buffer: %d Current Frames in system buffer: %d\n", *CurrentBuffer, TotalBufferedFrames);
-		if (*CurrentBuffer != TotalBufferedFrames) {
+		if (RejectedFrames)
+			Debug(3, "Frames refused by the drive: %d\n", RejectedFrames);
+		if (*CurrentBuffer + RejectedFrames != TotalBufferedFrames) {
 			Debug(0, "Tape/system buffer mismatch. Aborting!\n");
 			exit(-1);
 		}
@@ -1662,18 +2694,53 @@ unsigned int RequeueData(OnStream *pOnStream, TAPEBUFFER** TapeBuffer,
 		ThisTapeBuffer = ThisTapeBuffer->Next;
 	}
 	Debug(2, "All data requeued. We now return you to your regularly scheduled programming.\n");
+	*CurrentBuffer = TotalBufferedFrames;
+	UncheckedFrames = 0;
+	InferredFrames = 0;
+	RejectedFrames = 0;
 	return BadFrames;
 }
 
-void WaitForWrite(OnStream *pOnStream, TAPEBUFFER** TapeBuffer, unsigned int *CurrentTapeBuffer) 
+//***********************************************
+// DrainWait: how long to sleep before looking at the drive buffer again
+// Inputs:  frames still to drain, measured drain rate (frames/s, 0 if not
+//          known yet) and the number of samples without progress
+// Outputs: microseconds, between DRAIN_POLL_MIN and DRAIN_POLL_MAX
+long DrainWait(unsigned int frames, double rate, unsigned int idle) 
+{
+	double usecs;
+
+	if (rate > 0)
+		usecs = 1000000.0 * frames / rate;
+	else
+		usecs = (double) (DRAIN_POLL_MIN << (idle < 6 ? idle : 6));
+
+	if (usecs < DRAIN_POLL_MIN)
+		return DRAIN_POLL_MIN;
+	if (usecs > DRAIN_POLL_MAX)
+		return DRAIN_POLL_MAX;
+	return (long) usecs;
+}
+
+//***********************************************
+// WaitForWrite: wait until the drive buffer holds no more than target frames
+// The drain rate is estimated from successive buffer status samples, so we
+// sleep just about as long as the drive needs instead of polling blindly.
+void WaitForWrite(OnStream *pOnStream, TAPEBUFFER** TapeBuffer, unsigned int *CurrentTapeBuffer, 
+		  unsigned int target) 
 {
 	// Wait for Write
-	unsigned int CurrentBuffer, MaxBuffer;
+	unsigned int CurrentBuffer, MaxBuffer, LastBuffer;
+	unsigned int idle = 0;
 	int skip; unsigned char sense[16];
 	Sense CurrentSense;
+	struct timeval now, last;
+	double rate = 0, elapsed;
+	long usecs;
 
 	pOnStream->BufferStatus(&MaxBuffer, &CurrentBuffer);
-	while (CurrentBuffer > 0) {
+	gettimeofday(&last, NULL);
+	while (CurrentBuffer > target) {
 		if (false == pOnStream->Write(NULL, 0)) {
 			Debug(0, "main: write failed: '%s'\n", szOnStreamErrors[pOnStream->GetLastError()]);
 			CheckSense(pOnStream);
@@ -1682,60 +2749,2284 @@ void WaitForWrite(OnStream *pOnStream, TAPEBUFFER** TapeBuffer, unsigned int *Cu
 		}
 		switch (CurrentSense = CheckSense(pOnStream)) {
 		case SNoSense:
-			CheckWrittenFrames(pOnStream, TapeBuffer, 0, CurrentTapeBuffer);
 			break;
 		case SMediumWriteError:
 			pOnStream->GetLastSense (sense); 
 			skip = (unsigned int) sense[9];
 			if (!skip) skip = 80;
 			RequeueData(pOnStream, TapeBuffer, 0, CurrentTapeBuffer, 80);
+			/* The drive has repositioned, start measuring afresh */
+			rate = 0;
+			idle = 0;
 			break;
 		default:
 			Debug(0, "Unhandled sense %d\n", CurrentSense);
 			exit(-1);
 		}
-		sleep(1);
-		pOnStream->BufferStatus(&MaxBuffer, &CurrentBuffer);
+
+		usecs = DrainWait(CurrentBuffer - target, rate, idle);
+		Debug(5, "Drive buffer %d, draining at %.1f frames/s, next look in %ld ms\n", 
+		      CurrentBuffer, rate, usecs / 1000);
+		usleep(usecs);
+
+		LastBuffer = CurrentBuffer;
+		CheckWrittenFrames(pOnStream, TapeBuffer, 0, CurrentTapeBuffer);
+		CurrentBuffer = *CurrentTapeBuffer;
+		gettimeofday(&now, NULL);
+		elapsed = (now.tv_sec - last.tv_sec) + (now.tv_usec - last.tv_usec) / 1000000.0;
+		last = now;
+
+		if (CurrentBuffer < LastBuffer && elapsed > 0) {
+			/* Smooth the rate a bit, the drive writes in bursts */
+			double sample = (LastBuffer - CurrentBuffer) / elapsed;
+			rate = rate > 0 ? (rate + sample) / 2 : sample;
+			idle = 0;
+		} else {
+			idle++;
+		}
 	}
 }
 
-
-void AddFrameToBuffer(TAPEBUFFER **LastBuffer, void *buf) 
+//***********************************************
+// SyncQueuedWrites: reap queued WRITEs until at most nKeep are outstanding
+// Inputs:  number of WRITEs that may stay queued, tape buffer counter
+// Outputs: SNoSense, or the sense of the first WRITE that failed. Then the
+//          whole queue has been reaped and RejectedFrames counts the frames
+//          the drive did not take, ready for RequeueData().
+Sense SyncQueuedWrites(OnStream *pOnStream, unsigned int nKeep, unsigned int *CurrentTapeBuffer) 
 {
-	TAPEBUFFER *ThisTapeBuffer;
-
-	Debug(6, "Adding 1 frame to tape buffer\n");
-	ThisTapeBuffer = (TAPEBUFFER *) malloc(sizeof(TAPEBUFFER));
-	ThisTapeBuffer->Next = NULL;
-	if (*LastBuffer != NULL)
-		(*LastBuffer)->Next = ThisTapeBuffer;
-
-	if (TapeBuffer == NULL)
-		TapeBuffer = *LastBuffer;
+	Sense FirstSense = SNoSense, ThisSense;
+	UINT32 tag;
+
+	while (pOnStream->Outstanding() > (FirstSense == SNoSense ? nKeep : 0)) {
+		if (false == pOnStream->Complete(&tag)) {
+			Debug(0, "main: write failed: '%s'\n", szOnStreamErrors[pOnStream->GetLastError()]);
+			delete pOnStream;
+			exit(-1);
+		}
+		if (SNoSense == (ThisSense = CheckSense(pOnStream)))
+			continue;
+		Debug(2, "Queued write of frame (Seq No = %ld) failed\n", tag);
+		if (FirstSense == SNoSense)
+			FirstSense = ThisSense;
+		RejectedFrames++;
+	}
+	if (FirstSense != SNoSense)
+		return FirstSense;
+
+	/* Asking for the buffer status waits for all queued commands, so
+	 * only do that every QueueDepth() frames. Reap them all first: a
+	 * frame whose WRITE may still fail must not be freed. */
+	if (UncheckedFrames >= pOnStream->QueueDepth() || (0 == nKeep && UncheckedFrames)) {
+		if (nKeep)
+			return SyncQueuedWrites(pOnStream, 0, CurrentTapeBuffer);
+		CheckWrittenFrames(pOnStream, &TapeBuffer, 0, CurrentTapeBuffer);
+	}
+	return SNoSense;
+}
+
+//***********************************************
+// ReadFrame: read the next frame, from the read-ahead ring in queued mode
+// Inputs:  read-ahead ring, buffer to use if not queuing
+// Outputs: pointer to the frame (valid until the next call), NULL if sg failed
+unsigned char* ReadFrame(OnStream *pOnStream, READAHEAD *pReadAhead, unsigned char *buf) 
+{
+	unsigned int depth = pOnStream->QueueDepth(), slot;
+	UINT32 tag;
+
+	if (depth <= 1)
+		return pOnStream->Read(buf) ? buf : NULL;
+
+	/* The slot handed out last time is free again, refill the queue */
+	while (pOnStream->Outstanding() < depth) {
+		slot = (pReadAhead->nNext + pOnStream->Outstanding()) % depth;
+		if (false == pOnStream->QueueRead(&pReadAhead->Frames[slot * 33280], slot))
+			return NULL;
+	}
+	if (false == pOnStream->Complete(&tag))
+		return NULL;
+	pReadAhead->nNext = (pReadAhead->nNext + 1) % depth;
+	return &pReadAhead->Frames[tag * 33280];
+}
+
+//***********************************************
+// CancelReadAhead: throw away outstanding READs before a Locate()
+void CancelReadAhead(OnStream *pOnStream, READAHEAD *pReadAhead) 
+{
+	while (pOnStream->Outstanding() > 0) {
+		if (false == pOnStream->Complete(NULL)) {
+			Debug(0, "main: Read failed: '%s'\n", szOnStreamErrors[pOnStream->GetLastError()]);
+			delete pOnStream;
+			exit(-1);
+		}
+	}
+	pReadAhead->nNext = 0;
+}
+
+//***********************************************
+// NextFrame: read the next frame
+// Outputs: its sequence number, -1 if it is not a data, marker or EOD
+//          frame of this write pass, -2 if it could not be read
+long NextFrame(OnStream *pOnStream, READAHEAD *pReadAhead, unsigned char *buf, 
+	       unsigned int WritePass, unsigned char **frame) 
+{
+	AUX_FRAME AuxFrame;
+
+	if (NULL == (*frame = ReadFrame(pOnStream, pReadAhead, buf))) {
+		Debug(0, "main: Read failed: '%s'\n", szOnStreamErrors[pOnStream->GetLastError()]);
+		delete pOnStream;
+		exit(1);
+	}
+	if (SNoSense != CheckSense(pOnStream))
+		return -2;
+	unFormatAuxFrame(&(*frame)[32768], &AuxFrame);
+	if (AuxFrame.PartitionDescription.WritePassCounter != WritePass)
+		return -1;
+	switch (AuxFrame.FrameType) {
+	case 0x8000:
+	case 0x0200:
+	case 0x0100:
+		return AuxFrame.FrameSequenceNumber;
+	}
+	return -1;
+}
+
+//***********************************************
+// ProbeFrame: locate to a frame and read it, see NextFrame()
+long ProbeFrame(OnStream *pOnStream, READAHEAD *pReadAhead, unsigned char *buf, 
+		unsigned int WritePass, UINT32 Frame, unsigned char **frame) 
+{
+	long SeqNo;
+
+	CancelReadAhead(pOnStream, pReadAhead);
+	if (false == pOnStream->Locate(Frame) || false == pOnStream->StartRead()) {
+		Debug(0, "main: Locate failed: '%s'\n", szOnStreamErrors[pOnStream->GetLastError()]);
+		delete pOnStream;
+		exit(1);
+	}
+	WaitForReady(pOnStream);
+	SeqNo = NextFrame(pOnStream, pReadAhead, buf, WritePass, frame);
+	Debug(2, "Probed frame %lu: sequence number %ld\n", Frame, SeqNo);
+	return SeqNo;
+}
+
+//***********************************************
+// FindLogicalFrame: look for the frame with sequence number Want after a
+// read error or a jump in the sequence numbers, in the spirit of
+// osst_get_logical_frame(). Frames of a write pass are on tape in
+// sequence, with stretches of unreadable, blank or stale frames between
+// them, so we
+// - step forward over frames that tell nothing, in growing steps,
+// - from a frame numbered below Want jump ahead by the difference,
+// - past a frame numbered above Want halve the bracket it makes with the
+//   last one below, and read what is left of it through.
+// Inputs:  Low: frames before it are numbered below Want; Frame: where
+//          to start looking
+// Outputs: the frame with the lowest number >= Want found, its position
+//          and number; false if nothing turned up
+bool FindLogicalFrame(OnStream *pOnStream, READAHEAD *pReadAhead, unsigned char *buf, 
+		      unsigned int WritePass, unsigned long Want, UINT32 Low, UINT32 Frame, 
+		      unsigned char **frame, UINT32 *Position, unsigned long *SeqNo) 
+{
+	unsigned int nProbes = 0, step = 1;
+	unsigned long HiSeq;
+	UINT32 Hi, q;
+	long s;
+
+	Debug(1, "Looking for sequence number %lu from frame %lu\n", Want, Frame);
+	for (;;) {
+		if (nProbes++ >= RECOVER_MAX_PROBES || Frame >= Low + RECOVER_MAX_AHEAD) {
+			Debug(0, "No frame numbered %lu or above found, giving up\n", Want);
+			return false;
+		}
+		s = ProbeFrame(pOnStream, pReadAhead, buf, WritePass, Frame, frame);
+		if (s < 0) {
+			Frame += step;
+			step = step * 2 > RECOVER_MAX_STEP ? RECOVER_MAX_STEP : step * 2;
+			continue;
+		}
+		if ((unsigned long) s >= Want)
+			break;
+		Low = Frame + 1;
+		Frame += Want - s;
+		step = 1;
+	}
+	Hi = Frame;
+	HiSeq = s;
+
+	/* Want can only be in [Low, Hi - (HiSeq - Want)] */
+	while (Hi - Low > HiSeq - Want + RECOVER_SCAN && HiSeq > Want 
+	       && nProbes++ < RECOVER_MAX_PROBES) {
+		q = Low + (Hi - (HiSeq - Want) - Low) / 2;
+		s = ProbeFrame(pOnStream, pReadAhead, buf, WritePass, q, frame);
+		if (s < 0)
+			break;		/* nothing to go by */
+		if ((unsigned long) s < Want)
+			Low = q + 1;
+		else {
+			Hi = q;
+			HiSeq = s;
+		}
+	}
+
+	/* Read through to Hi. The first frame numbered >= Want is it. */
+	if (HiSeq > Want && Low < Hi) {
+		s = ProbeFrame(pOnStream, pReadAhead, buf, WritePass, q = Low, frame);
+		while (s < 0 || (unsigned long) s < Want) {
+			if (++q >= Hi)
+				break;
+			if (-2 == s)
+				s = ProbeFrame(pOnStream, pReadAhead, buf, WritePass, q, frame);
+			else
+				s = NextFrame(pOnStream, pReadAhead, buf, WritePass, frame);
+		}
+		if (q < Hi) {
+			*Position = q;
+			*SeqNo = s;
+			return true;
+		}
+	}
+	if (HiSeq > Want || *frame == NULL)
+		s = ProbeFrame(pOnStream, pReadAhead, buf, WritePass, Hi, frame);
+	*Position = Hi;
+	*SeqNo = s;
+	return s >= 0;
+}
+
+//***********************************************
+// RecoverRead: find CurrentSeqNo again, see FindLogicalFrame(), and
+// report the logical frames lost on the way
+// Inputs:  Low: position past the last good frame; *CurrentFrame: where
+//          to start looking
+// Outputs: false if nothing more can be read; else the frame to go on
+//          with, *CurrentFrame its position and *CurrentSeqNo its number
+bool RecoverRead(OnStream *pOnStream, READAHEAD *pReadAhead, unsigned char *buf, 
+		 unsigned int WritePass, unsigned long *CurrentSeqNo, UINT32 Low, 
+		 UINT32 *CurrentFrame, unsigned char **frame, LOSTFRAMES *pLost) 
+{
+	unsigned long SeqNo;
+	UINT32 Position;
+
+	*frame = NULL;
+	if (!FindLogicalFrame(pOnStream, pReadAhead, buf, WritePass, *CurrentSeqNo, Low, 
+			      *CurrentFrame, frame, &Position, &SeqNo)) {
+		pLost->fGaveUp = true;
+		return false;
+	}
+	if (SeqNo > *CurrentSeqNo) {
+		/* Filemarks and compression keep frames and data bytes apart,
+		 * so only the frame sequence numbers are told */
+		Debug(0, "Lost logical frames %lu-%lu (%lu frames)\n", 
+		      *CurrentSeqNo, SeqNo - 1, SeqNo - *CurrentSeqNo);
+		pLost->nFrames += SeqNo - *CurrentSeqNo;
+		pLost->nRanges++;
+		*CurrentSeqNo = SeqNo;
+	}
+	Debug(1, "Found sequence number %lu at frame %lu\n", SeqNo, Position);
+	*CurrentFrame = Position;
+	return true;
+}
+
+//***********************************************
+// Frame queue between the tape loop and the file I/O thread. There is
+// exactly one producer and one consumer, so the two counters are all the
+// synchronisation needed; an empty or full queue is waited out with short
+// sleeps.
+bool FrameQueueInit(FRAMEQUEUE *pQueue, unsigned int nSlots, FILE *pFile, OUTPUT *pOutput) 
+{
+	pQueue->Frames = (unsigned char *) malloc(nSlots * 33280);
+	pQueue->Sizes  = (unsigned int *) malloc(nSlots * sizeof(unsigned int));
+	pQueue->Syncs  = (unsigned int *) malloc(nSlots * sizeof(unsigned int));
+	if (NULL == pQueue->Frames || NULL == pQueue->Sizes || NULL == pQueue->Syncs)
+		return false;
+	pQueue->nSlots = nSlots;
+	pQueue->nHead  = 0;
+	pQueue->nTail  = 0;
+	pQueue->fDone  = 0;
+	pQueue->File   = pFile;
+	pQueue->Output = pOutput;
+	pQueue->Source = NULL;
+	pQueue->nBytes = 0;
+	return true;
+}
+
+// FrameQueueReserve: producer side, wait for a free slot
+// Outputs: the slot, NULL if the consumer has gone
+unsigned char* FrameQueueReserve(FRAMEQUEUE *pQueue) 
+{
+	unsigned int tail = pQueue->nTail;
+
+	while (tail - __atomic_load_n(&pQueue->nHead, __ATOMIC_ACQUIRE) >= pQueue->nSlots) {
+		if (__atomic_load_n(&pQueue->fDone, __ATOMIC_ACQUIRE))
+			return NULL;
+		usleep(1000);
+	}
+	return &pQueue->Frames[(tail % pQueue->nSlots) * 33280];
+}
+
+// FrameQueueCommit: producer side, publish the reserved slot
+void FrameQueueCommit(FRAMEQUEUE *pQueue, unsigned int size, unsigned int sync = 0) 
+{
+	pQueue->Sizes[pQueue->nTail % pQueue->nSlots] = size;
+	pQueue->Syncs[pQueue->nTail % pQueue->nSlots] = sync;
+	__atomic_store_n(&pQueue->nTail, pQueue->nTail + 1, __ATOMIC_RELEASE);
+}
+
+// FrameQueuePeek: consumer side, wait for the next frame
+// Outputs: the frame and its size, NULL if the producer is done
+unsigned char* FrameQueuePeek(FRAMEQUEUE *pQueue, unsigned int *size, unsigned int *sync = NULL) 
+{
+	unsigned int head = pQueue->nHead;
+
+	while (__atomic_load_n(&pQueue->nTail, __ATOMIC_ACQUIRE) == head) {
+		if (__atomic_load_n(&pQueue->fDone, __ATOMIC_ACQUIRE)
+		    && __atomic_load_n(&pQueue->nTail, __ATOMIC_ACQUIRE) == head)
+			return NULL;
+		usleep(1000);
+	}
+	*size = pQueue->Sizes[head % pQueue->nSlots];
+	if (NULL != sync)
+		*sync = pQueue->Syncs[head % pQueue->nSlots];
+	return &pQueue->Frames[(head % pQueue->nSlots) * 33280];
+}
+
+// FrameQueueRelease: consumer side, hand the slot back
+void FrameQueueRelease(FRAMEQUEUE *pQueue) 
+{
+	__atomic_store_n(&pQueue->nHead, pQueue->nHead + 1, __ATOMIC_RELEASE);
+}
+
+// ReadInput: read input for a thread filling the queue. A quiet pipe is
+// polled, so the thread still notices a signal or the write loop going
+// away. The input must be unbuffered (_IONBF), see main().
+// Outputs: the bytes read, short only at the end of the input; -1 if the
+//          thread is to stop
+ssize_t ReadInput(FRAMEQUEUE *pQueue, unsigned char *buf, size_t n) 
+{
+	struct pollfd pfd;
+	size_t done = 0;
+	ssize_t rc;
+
+	pfd.fd = fileno(pQueue->File);
+	pfd.events = POLLIN;
+	while (done < n) {
+		if (signalled || __atomic_load_n(&pQueue->fDone, __ATOMIC_ACQUIRE))
+			return -1;
+		rc = poll(&pfd, 1, INPUT_POLL);
+		if (rc < 0 && EINTR != errno)
+			break;
+		if (rc <= 0)
+			continue;
+		rc = read(pfd.fd, &buf[done], n - done);
+		if (rc < 0 && EINTR == errno)
+			continue;
+		if (rc <= 0)
+			break;
+		done += rc;
+	}
+	return done;
+}
+
+// InputThread: fill frames from the input file for the write loop. Every
+// frame but the last one carries 32768 bytes.
+void* InputThread(void *arg) 
+{
+	FRAMEQUEUE *pQueue = (FRAMEQUEUE *) arg;
+	unsigned char *slot;
+	ssize_t rc;
+
+	do {
+		if (NULL == (slot = FrameQueueReserve(pQueue)))
+			break;
+		if ((rc = ReadInput(pQueue, slot, 32768)) < 0)
+			break;
+		if (rc < 32768)
+			memset(&slot[rc], 0, 32768 - rc);
+		pQueue->nBytes += rc;
+		FrameQueueCommit(pQueue, rc);
+	} while (rc == 32768);
+	__atomic_store_n(&pQueue->fDone, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+//***********************************************
+// Tape copy (-C)
+
+/* The drive copied from, read by CopyThread */
+struct COPYSOURCE {
+	OnStream     *pOnStream;
+	READAHEAD     ReadAhead;
+	unsigned int  WritePass;
+	UINT32        StartFrame;
+	unsigned long nFrames;
+	LOSTFRAMES    Lost;
+};
+
+/* Where the target got its marker frames, for the header */
+struct FILEMARKS {
+	UINT32       Frames[FM_TAB_MAX];
+	unsigned int nMarks;
+};
+
+// OpenCopySource: open the drive to copy from and find the write pass
+// and first user frame of its tape
+// Inputs:  SCSI device number or tape image, queue depth for reading
+bool OpenCopySource(const char *name, unsigned int queuedepth, COPYSOURCE *pSource) 
+{
+	char deviceName[256];
+	unsigned char buf[33280];
+	OnStream *pOnStream;
+	AUX_FRAME Aux;
+
+	if (strspn(name, "0123456789") == strlen(name))
+		snprintf(deviceName, sizeof(deviceName), "/dev/sg%s", name);
+	else
+		snprintf(deviceName, sizeof(deviceName), "%s", name);
+	memset(pSource, 0, sizeof(*pSource));
+	pSource->pOnStream = pOnStream = new OnStream(deviceName, strspn(name, "0123456789") != strlen(name), true);
+	if (!pOnStream->IsOnstream())
+		return false;
+	if (queuedepth > 1 && pOnStream->SetQueueDepth(queuedepth) > 1)
+		pSource->ReadAhead.Frames = (unsigned char *) malloc(pOnStream->QueueDepth() * 33280);
+
+	pOnStream->VendorID((char *) VENDORID);
+	WaitForReady(pOnStream);
+	pOnStream->LULoad();
+	WaitForReady(pOnStream);
+	pOnStream->DataTransferMode(true);
+	CheckSense(pOnStream);
+	if (!ReadFrameAt(pOnStream, 5, buf, &Aux) 
+	    || (strncmp((char *) buf, "ADR-SEQ", 7) && strncmp((char *) buf, "ADR_SEQ", 7))) {
+		Debug(0, "Copy source %s: tape format not understood\n", deviceName);
+		return false;
+	}
+	cpAndSwap(&pSource->WritePass, &buf[22], 2);
+	pSource->StartFrame = 1000 * buf[8] + 2 * buf[9] < 1004 ? 16 : 10;
+	Debug(2, "Copy source %s: write pass %u, user data from frame %lu\n", deviceName, 
+	      pSource->WritePass, pSource->StartFrame);
+	return true;
+}
+
+// CopyThread: read the data and marker frames of the last write pass
+// from the source drive, AUX and all, for the write loop. Read errors
+// are dealt with as by the restore, see RecoverRead().
+void* CopyThread(void *arg) 
+{
+	FRAMEQUEUE *pQueue = (FRAMEQUEUE *) arg;
+	COPYSOURCE *pSource = pQueue->Source;
+	OnStream *pOnStream = pSource->pOnStream;
+	unsigned char *slot, *frame, *pending = NULL;
+	UINT32 CurrentFrame = pSource->StartFrame, LastGood = CurrentFrame;
+	unsigned long SeqNo = 0;
+	bool started = false;
+	AUX_FRAME Aux;
+	long s;
+
+	slot = NULL;
+	if (false == pOnStream->Locate(CurrentFrame)) 
+		Debug(0, "Copy: Locate failed: '%s'\n", szOnStreamErrors[pOnStream->GetLastError()]);
+	else {
+		WaitForReady(pOnStream);
+		if (false == pOnStream->StartRead()) 
+			Debug(0, "Copy: Read failed: '%s'\n", szOnStreamErrors[pOnStream->GetLastError()]);
+		else {
+			WaitForReady(pOnStream);
+			slot = FrameQueueReserve(pQueue);
+		}
+	}
+	if (NULL == slot)
+		pSource->Lost.fGaveUp = true;
+	while (NULL != slot && !signalled) {
+		if (NULL != pending) {
+			frame = pending;
+			pending = NULL;
+			s = SeqNo;
+		} else if (OS_NEED_POLL(pOnStream->FWRev()) 
+			   && SNoSense != pOnStream->WaitPosition(CurrentFrame))
+			s = -2;
+		else
+			s = NextFrame(pOnStream, &pSource->ReadAhead, slot, pSource->WritePass, &frame);
+		if (-2 == s || (started && s > (long) SeqNo)) {
+			/* Unreadable, or we missed some */
+			if (-2 == s)
+				CurrentFrame++;
+			if (!RecoverRead(pOnStream, &pSource->ReadAhead, slot, pSource->WritePass, &SeqNo, 
+					 LastGood, &CurrentFrame, &pending, &pSource->Lost))
+				break;
+			started = true;
+			continue;
+		}
+		CurrentFrame++;
+		if (-1 == s || (started && s < (long) SeqNo))
+			continue;
+		unFormatAuxFrame(&frame[32768], &Aux);
+		if (0x0100 == Aux.FrameType)
+			break;
+		started = true;
+		SeqNo = s + 1;
+		LastGood = CurrentFrame;
+		if (frame != slot)
+			memcpy(slot, frame, 33280);
+		FrameQueueCommit(pQueue, 0x8000 == Aux.FrameType ? 
+				 Aux.DataAccessTable.DataAccessTableEntry[0].size : 0);
+		pSource->nFrames++;
+		slot = FrameQueueReserve(pQueue);
+	}
+	CancelReadAhead(pOnStream, &pSource->ReadAhead);
+	__atomic_store_n(&pQueue->fDone, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+// RestampFrame: make a frame of the source tape one of the target. Write
+// pass, partition, sequence number and the physical addresses are the
+// target's, from *pAuxFrame (the write loop's); LBA, data access table,
+// filemark count and DriverUnique stay as they were.
+// Inputs:  frame, where it goes, the markers written so far
+void RestampFrame(AUX_FRAME *pAuxFrame, unsigned char *frame, UINT32 Position, FILEMARKS *pMarks) 
+{
+	AUX_FRAME Aux;
+
+	unFormatAuxFrame(&frame[32768], &Aux);
+	memcpy(&Aux.ApplicationSig, &pAuxFrame->ApplicationSig, 4);
+	Aux.UpdateFrameCounter = 0;
+	Aux.PartitionDescription = pAuxFrame->PartitionDescription;
+	Aux.FrameSequenceNumber = pAuxFrame->FrameSequenceNumber;
+	Aux.LastMarkFrameAddress = pAuxFrame->LastMarkFrameAddress;
+	if (0x0200 == Aux.FrameType) {
+		if (pMarks->nMarks < FM_TAB_MAX)
+			pMarks->Frames[pMarks->nMarks] = Position;
+		pMarks->nMarks++;
+		pAuxFrame->LastMarkFrameAddress = Position;
+	}
+	/* for the EOD frame */
+	pAuxFrame->LogicalBlockAddress = Aux.LogicalBlockAddress;
+	pAuxFrame->FilemarkCount = Aux.FilemarkCount;
+	FormatAuxFrame(Aux, &frame[32768]);
+}
+
+// OutputOpen: set up the output of a restore
+// Inputs:  the output file, whether to stick to stdio and how many bytes
+//          are expected, if known (0 otherwise)
+// Outputs: false if out of memory
+bool OutputOpen(OUTPUT *pOutput, FILE *pFile, bool fPlain, unsigned long long nExpected) 
+{
+	struct stat st;
+	char szPath[32];
+	int flags, fd;
+
+	memset(pOutput, 0, sizeof(*pOutput));
+	pOutput->Mode = omStdio;
+	pOutput->File = pFile;
+	pOutput->fd   = pOutput->fdCaller = fileno(pFile);
+	fflush(pFile);
+	if (fPlain || fstat(pOutput->fd, &st) < 0)
+		return true;
+
+	if (S_ISFIFO(st.st_mode)) {
+		fcntl(pOutput->fd, F_SETPIPE_SZ, OUTPUT_PIPE);
+		pOutput->Mode = omPipe;
+		Debug(2, "Output to pipe using vmsplice\n");
+		return true;
+	} else if (S_ISREG(st.st_mode)) {
+		flags = fcntl(pOutput->fd, F_GETFL);
+		pOutput->Offset = lseek(pOutput->fd, 0, SEEK_CUR);
+		pOutput->Mode = omFile;
+		if (!(flags & O_APPEND) && 0 == pOutput->Offset % 4096) {
+			/* O_DIRECT on a descriptor of our own: the caller's one
+			 * may be shared with whoever writes after us */
+			snprintf(szPath, sizeof(szPath), "/proc/self/fd/%d", pOutput->fd);
+			fd = open(szPath, O_WRONLY | O_DIRECT);
+			if (-1 != fd && lseek(fd, pOutput->Offset, SEEK_SET) == pOutput->Offset) {
+				pOutput->fd = fd;
+				pOutput->Mode = omDirect;
+			} else if (-1 != fd)
+				close(fd);
+		}
+		pOutput->nSlots = OUTPUT_BATCH;
+		pOutput->Allocated = pOutput->Offset;
+		pOutput->fPrealloc = !(flags & O_APPEND);
+		if (pOutput->fPrealloc && nExpected > 0 && fallocate(pOutput->fd, 
+				FALLOC_FL_KEEP_SIZE, pOutput->Offset, nExpected) == 0)
+			pOutput->Allocated += nExpected;
+	} else
+		return true;
+
+	if (posix_memalign((void **) &pOutput->Slots, 4096, pOutput->nSlots * OUTPUT_SLOT)) {
+		Debug(0, "OutputOpen: out of memory\n");
+		return false;
+	}
+	Debug(2, "Output to %s\n", omDirect == pOutput->Mode ? "file using direct I/O" : "file");
+	return true;
+}
+
+//***********************************************
+// OutputReserve: the buffer to read the next frame into
+// Inputs:  buffer to use if the output has none of its own
+unsigned char* OutputReserve(OUTPUT *pOutput, unsigned char *buf) 
+{
+	if (omStdio == pOutput->Mode)
+		return buf;
+	if (omPipe == pOutput->Mode) {
+		if (NULL == pOutput->Fresh) {
+			pOutput->Fresh = (unsigned char *) mmap(NULL, OUTPUT_SLOT, PROT_READ | PROT_WRITE,
+								MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (MAP_FAILED == pOutput->Fresh)
+				pOutput->Fresh = NULL;
+		}
+		return NULL != pOutput->Fresh ? pOutput->Fresh : buf;
+	}
+	return &pOutput->Slots[pOutput->nNext * OUTPUT_SLOT];
+}
+
+//***********************************************
+// OutputFlush: write the frames collected for a direct write
+bool OutputFlush(OUTPUT *pOutput) 
+{
+	struct iovec *iov = pOutput->Pending;
+	unsigned int n = pOutput->nPending;
+	ssize_t rc;
+
+	pOutput->nPending = 0;
+	while (n > 0) {
+		rc = writev(pOutput->fd, iov, n);
+		if (rc < 0 && EINTR == errno)
+			continue;
+		if (rc < 0 && EINVAL == errno && omDirect == pOutput->Mode) {
+			/* The file system wants no direct I/O after all */
+			fcntl(pOutput->fd, F_SETFL, fcntl(pOutput->fd, F_GETFL) & ~O_DIRECT);
+			pOutput->Mode = omFile;
+			continue;
+		}
+		if (rc < 0)
+			return false;
+		pOutput->Offset += rc;
+		while (n > 0 && (size_t) rc >= iov->iov_len) {
+			rc -= iov->iov_len;
+			iov++;
+			n--;
+		}
+		if (n > 0) {
+			iov->iov_base = (char *) iov->iov_base + rc;
+			iov->iov_len -= rc;
+		}
+	}
+	return true;
+}
+
+//***********************************************
+// OutputCommit: write nBytes of a frame
+// Inputs:  the frame, which is copied unless it was read into the buffer
+//          OutputReserve() returned, and its size
+// Outputs: false on write errors
+bool OutputCommit(OUTPUT *pOutput, unsigned char *frame, unsigned int nBytes) 
+{
+	unsigned char *slot;
+	struct iovec iov;
+	ssize_t rc;
+
+	if (omStdio == pOutput->Mode)
+		return fwrite(frame, 1, nBytes, pOutput->File) == nBytes;
+
+	if (omPipe == pOutput->Mode) {
+		/* The frame's pages are gifted to the pipe and dropped here */
+		slot = OutputReserve(pOutput, NULL);
+		pOutput->Fresh = NULL;
+		if (NULL == slot) {
+			Debug(2, "no pages for vmsplice, using write\n");
+			pOutput->Mode = omStdio;
+			return fwrite(frame, 1, nBytes, pOutput->File) == nBytes;
+		}
+		if (frame != slot)
+			memcpy(slot, frame, nBytes);
+		iov.iov_base = slot;
+		iov.iov_len  = nBytes;
+		while (iov.iov_len > 0) {
+			rc = vmsplice(pOutput->fd, &iov, 1, SPLICE_F_GIFT);
+			if (rc < 0 && EINTR == errno)
+				continue;
+			if (rc < 0 && (EINVAL == errno || ENOSYS == errno)) {
+				Debug(2, "vmsplice not available, using write\n");
+				pOutput->Mode = omStdio;
+				rc = fwrite(iov.iov_base, 1, iov.iov_len, pOutput->File) == iov.iov_len;
+				munmap(slot, OUTPUT_SLOT);
+				return rc;
+			}
+			if (rc < 0) {
+				munmap(slot, OUTPUT_SLOT);
+				return false;
+			}
+			iov.iov_base = (char *) iov.iov_base + rc;
+			iov.iov_len -= rc;
+		}
+		munmap(slot, OUTPUT_SLOT);
+		pOutput->Offset += nBytes;
+		return true;
+	}
+
+	slot = &pOutput->Slots[pOutput->nNext * OUTPUT_SLOT];
+	if (frame != slot)
+		memcpy(slot, frame, nBytes);
+	pOutput->nNext = (pOutput->nNext + 1) % pOutput->nSlots;
+
+	if (pOutput->fPrealloc 
+	    && pOutput->Offset + (off_t) (pOutput->nPending + 1) * 32768 > pOutput->Allocated) {
+		/* Keep the file system ahead of us */
+		if (fallocate(pOutput->fd, FALLOC_FL_KEEP_SIZE, pOutput->Allocated, OUTPUT_PREALLOC) == 0)
+			pOutput->Allocated += OUTPUT_PREALLOC;
+		else
+			pOutput->fPrealloc = false;
+	}
+	pOutput->Pending[pOutput->nPending].iov_base = slot;
+	pOutput->Pending[pOutput->nPending].iov_len  = nBytes;
+	pOutput->nPending++;
+	if (nBytes % 4096 && omDirect == pOutput->Mode) {
+		/* Direct I/O only does whole blocks. A short frame normally
+		 * ends the restore, so write the rest through the cache. */
+		pOutput->nPending--;
+		if (!OutputFlush(pOutput))
+			return false;
+		fcntl(pOutput->fd, F_SETFL, fcntl(pOutput->fd, F_GETFL) & ~O_DIRECT);
+		pOutput->Mode = omFile;
+		pOutput->Pending[0].iov_base = slot;
+		pOutput->Pending[0].iov_len  = nBytes;
+		pOutput->nPending = 1;
+	}
+	if (OUTPUT_BATCH == pOutput->nPending || omFile == pOutput->Mode)
+		return OutputFlush(pOutput);
+	return true;
+}
+
+//***********************************************
+// OutputClose: write what is left and give back unused preallocation
+bool OutputClose(OUTPUT *pOutput) 
+{
+	bool ok = true;
+
+	if (omDirect == pOutput->Mode || omFile == pOutput->Mode) {
+		ok = OutputFlush(pOutput);
+		/* Blocks allocated past the end are kept by KEEP_SIZE */
+		if (pOutput->Allocated > pOutput->Offset && ftruncate(pOutput->fd, pOutput->Offset) < 0)
+			ok = false;
+	}
+	if (pOutput->fd != pOutput->fdCaller) {
+		/* Leave the caller's fd after what we wrote */
+		close(pOutput->fd);
+		pOutput->fd = pOutput->fdCaller;
+		if (lseek(pOutput->fd, pOutput->Offset, SEEK_SET) < 0)
+			ok = false;
+	}
+	if (omStdio == pOutput->Mode)
+		ok = fflush(pOutput->File) == 0;
+	if (NULL != pOutput->Fresh)
+		munmap(pOutput->Fresh, OUTPUT_SLOT);
+	free(pOutput->Slots);
+	pOutput->Slots = NULL;
+	return ok;
+}
+
+//***********************************************
+// OutputThread: write the frames the read loop has queued to the output file
+void* OutputThread(void *arg) 
+{
+	FRAMEQUEUE *pQueue = (FRAMEQUEUE *) arg;
+	unsigned char *frame;
+	unsigned int size;
+
+	while (NULL != (frame = FrameQueuePeek(pQueue, &size))) {
+		if (NULL != pQueue->Output) {
+			if (!OutputCommit(pQueue->Output, frame, size))
+				Debug(0, "Write to output file failed: %s\n", strerror(errno));
+		} else if (fwrite(frame, 1, size, pQueue->File) < size)
+			Debug(0, "Write to output file failed: %s\n", strerror(errno));
+		pQueue->nBytes += size;
+		FrameQueueRelease(pQueue);
+	}
+	fflush(pQueue->File);
+	return NULL;
+}
+
+// StartFrameQueue: set up a queue of nSlots frames and its I/O thread
+bool StartFrameQueue(FRAMEQUEUE *pQueue, unsigned int nSlots, FILE *pFile, 
+		     void* (*pThread)(void *), pthread_t *pThreadID, OUTPUT *pOutput = NULL, 
+		     COPYSOURCE *pSource = NULL) 
+{
+	sigset_t all, old;
+	int rc;
+
+	if (!FrameQueueInit(pQueue, nSlots, pFile, pOutput))
+		return false;
+	pQueue->Source = pSource;
+	/* Leave the signals to the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	rc = pthread_create(pThreadID, NULL, pThread, pQueue);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	return 0 == rc;
+}
+
+// StopFrameQueue: tell the I/O thread we are done, wait for it and clean up
+void StopFrameQueue(FRAMEQUEUE *pQueue, pthread_t ThreadID) 
+{
+	__atomic_store_n(&pQueue->fDone, 1, __ATOMIC_RELEASE);
+	pthread_join(ThreadID, NULL);
+	free(pQueue->Frames);
+	free(pQueue->Sizes);
+	free(pQueue->Syncs);
+	pQueue->Frames = NULL;
+	pQueue->Sizes  = NULL;
+	pQueue->Syncs  = NULL;
+}
+
+//***********************************************
+// Compression (-z)
+
+/* A block of input on its way through a compression thread */
+struct COMPRESSJOB {
+	unsigned char *In;
+	unsigned char *Out;		/* header and stored data */
+	unsigned int   nIn;
+	unsigned int   nOut;
+	int            State;		/* CJ_... */
+};
+
+enum { CJ_FREE, CJ_FILLED, CJ_DONE };
+
+/* The compression threads work on jobs Worker, Worker + nWorkers, ... */
+struct COMPRESSOR {
+	COMPRESSJOB   *Jobs;
+	unsigned int   nJobs;
+	unsigned int   nWorkers;
+	unsigned int   Worker;		/* next one to start */
+	unsigned long  nNext;		/* next job to fill */
+	int            fDone;
+};
+
+/* The compressed stream of a restore, see Decompress() */
+struct INFLATE {
+	unsigned char *In;
+	unsigned int   nIn;
+	unsigned char *Out;
+	OUTPUT        *Output;
+	FRAMEQUEUE    *Queue;		/* used instead of Output, if set */
+	unsigned long long nBytes;
+	unsigned long  nSeq;		/* sequence number of the next frame */
+	bool           fSynced;		/* In starts at a block header */
+	unsigned long  nDropped;	/* blocks given up on */
+};
+
+#ifdef HAVE_ZLIB
+// CompressWorker: compress the jobs that are ours as they come in
+void* CompressWorker(void *arg) 
+{
+	COMPRESSOR *pCompressor = (COMPRESSOR *) arg;
+	unsigned int job = __atomic_fetch_add(&pCompressor->Worker, 1, __ATOMIC_ACQ_REL);
+	COMPRESSJOB *pJob;
+	uLongf nOut;
+	unsigned int u32;
+
+	for (;; job += pCompressor->nWorkers) {
+		pJob = &pCompressor->Jobs[job % pCompressor->nJobs];
+		while (CJ_FILLED != __atomic_load_n(&pJob->State, __ATOMIC_ACQUIRE)) {
+			if (__atomic_load_n(&pCompressor->fDone, __ATOMIC_ACQUIRE))
+				return NULL;
+			usleep(1000);
+		}
+		nOut = compressBound(COMPRESS_BLOCK);
+		if (Z_OK != compress2(&pJob->Out[COMPRESS_HEADER], &nOut, pJob->In, pJob->nIn, 
+				      COMPRESS_LEVEL) || nOut >= pJob->nIn) {
+			memcpy(&pJob->Out[COMPRESS_HEADER], pJob->In, pJob->nIn);
+			nOut = pJob->nIn | COMPRESS_RAW;
+		}
+		u32 = htonl(nOut);
+		memcpy(pJob->Out, &u32, 4);
+		u32 = htonl(pJob->nIn);
+		memcpy(&pJob->Out[4], &u32, 4);
+		pJob->nOut = COMPRESS_HEADER + (nOut & ~COMPRESS_RAW);
+		__atomic_store_n(&pJob->State, CJ_DONE, __ATOMIC_RELEASE);
+	}
+}
+
+// CompressThread: InputThread with compression. Blocks of input go to
+// CompressThreads threads; what they return is packed into the frames,
+// in the order it was read. Every frame but the last one is full.
+void* CompressThread(void *arg) 
+{
+	FRAMEQUEUE *pQueue = (FRAMEQUEUE *) arg;
+	COMPRESSOR Compressor;
+	pthread_t Workers[MAX_COMPRESS_THREADS];
+	COMPRESSJOB *pJob;
+	unsigned char *slot = NULL;
+	unsigned long nPacked = 0;
+	unsigned int counter, nSlot = 0, n, done, sync = COMPRESS_NOSYNC;
+	bool eof = false, gone = false;
+	ssize_t rc;
+
+	memset(&Compressor, 0, sizeof(Compressor));
+	Compressor.nWorkers = CompressThreads;
+	Compressor.nJobs = 2 * CompressThreads;
+	Compressor.Jobs = (COMPRESSJOB *) calloc(Compressor.nJobs, sizeof(COMPRESSJOB));
+	for (counter = 0; counter < Compressor.nJobs; counter++) {
+		Compressor.Jobs[counter].In  = (unsigned char *) malloc(COMPRESS_BLOCK);
+		Compressor.Jobs[counter].Out = (unsigned char *) malloc(COMPRESS_HEADER + 
+						compressBound(COMPRESS_BLOCK) + COMPRESS_BLOCK);
+	}
+	for (counter = 0; counter < Compressor.nWorkers; counter++)
+		pthread_create(&Workers[counter], NULL, CompressWorker, &Compressor);
+
+	while (!eof || nPacked < Compressor.nNext) {
+		/* Keep the compression threads busy */
+		while (!eof && Compressor.nNext < nPacked + Compressor.nJobs) {
+			pJob = &Compressor.Jobs[Compressor.nNext % Compressor.nJobs];
+			if ((rc = ReadInput(pQueue, pJob->In, COMPRESS_BLOCK)) < 0) {
+				gone = true;
+				break;
+			}
+			pJob->nIn = rc;
+			pQueue->nBytes += pJob->nIn;
+			eof = pJob->nIn < COMPRESS_BLOCK;
+			if (0 == pJob->nIn)
+				break;
+			__atomic_store_n(&pJob->State, CJ_FILLED, __ATOMIC_RELEASE);
+			Compressor.nNext++;
+		}
+		if (gone || nPacked == Compressor.nNext)
+			break;
+
+		/* Pack the next block into frames */
+		pJob = &Compressor.Jobs[nPacked % Compressor.nJobs];
+		while (CJ_DONE != __atomic_load_n(&pJob->State, __ATOMIC_ACQUIRE))
+			usleep(1000);
+		for (done = 0; done < pJob->nOut && !gone; done += n) {
+			if (NULL == slot && NULL == (slot = FrameQueueReserve(pQueue))) {
+				gone = true;
+				break;
+			}
+			if (0 == done && COMPRESS_NOSYNC == sync)
+				sync = nSlot;
+			n = pJob->nOut - done < 32768 - nSlot ? pJob->nOut - done : 32768 - nSlot;
+			memcpy(&slot[nSlot], &pJob->Out[done], n);
+			if ((nSlot += n) == 32768) {
+				FrameQueueCommit(pQueue, 32768, sync);
+				slot = NULL;
+				nSlot = 0;
+				sync = COMPRESS_NOSYNC;
+			}
+		}
+		if (gone)
+			break;
+		__atomic_store_n(&pJob->State, CJ_FREE, __ATOMIC_RELEASE);
+		nPacked++;
+	}
+	if (!gone && (NULL != slot || NULL != (slot = FrameQueueReserve(pQueue)))) {
+		memset(&slot[nSlot], 0, 32768 - nSlot);
+		FrameQueueCommit(pQueue, nSlot, sync);
+	}
+	__atomic_store_n(&Compressor.fDone, 1, __ATOMIC_RELEASE);
+	for (counter = 0; counter < Compressor.nWorkers; counter++)
+		pthread_join(Workers[counter], NULL);
+	for (counter = 0; counter < Compressor.nJobs; counter++) {
+		free(Compressor.Jobs[counter].In);
+		free(Compressor.Jobs[counter].Out);
+	}
+	free(Compressor.Jobs);
+	__atomic_store_n(&pQueue->fDone, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+#endif
+
+// DropBlock: give up on a bad compressed block and wait for the next
+// frame a block starts in
+bool DropBlock(INFLATE *pInflate, unsigned int nStored, unsigned int nRaw) 
+{
+	Debug(0, "Bad compressed block (%u/%u bytes) after %Lu bytes of output, dropped\n", 
+	      nStored, nRaw, pInflate->nBytes);
+	pInflate->nDropped++;
+	pInflate->nIn = 0;
+	pInflate->fSynced = false;
+	return true;
+}
+
+// Decompress: take the data of a frame flagged DAT_COMPRESSED and write
+// out the blocks it completes, in pieces of at most a frame. After lost
+// frames or a bad block, the blocks are picked up again at the first one
+// starting in a frame (sync, see COMPRESS_MAGIC).
+// Inputs:  the frame's data, its size, sequence number and sync
+// Outputs: false on write errors
+bool Decompress(INFLATE *pInflate, unsigned char *data, unsigned int nBytes, 
+		unsigned long SeqNo, unsigned int sync) 
+{
+	unsigned int nStored, nRaw, done, n, u32;
+	unsigned char *slot;
+#ifdef HAVE_ZLIB
+	uLongf nOut;
+#endif
+
+	if (NULL == pInflate->In) {
+		pInflate->In  = (unsigned char *) malloc(COMPRESS_HEADER + COMPRESS_BLOCK + 32768);
+		pInflate->Out = (unsigned char *) malloc(COMPRESS_BLOCK);
+	}
+	if (pInflate->fSynced && SeqNo != pInflate->nSeq) {
+		/* Frames are missing, and with them the rest of the block */
+		if (pInflate->nIn > 0) {
+			Debug(0, "Compressed block cut by lost frames, dropped after %Lu bytes of output\n", 
+			      pInflate->nBytes);
+			pInflate->nDropped++;
+		}
+		pInflate->nIn = 0;
+		pInflate->fSynced = false;
+	}
+	pInflate->nSeq = SeqNo + 1;
+	if (!pInflate->fSynced) {
+		if (sync > 0)
+			Debug(pInflate->nBytes ? 0 : 1, "Skipping %u bytes of frame %lu to the next compressed block\n", 
+			      sync < nBytes ? sync : nBytes, SeqNo);
+		if (sync >= nBytes)
+			return true;
+		data += sync;
+		nBytes -= sync;
+		pInflate->fSynced = true;
+	}
+	memcpy(&pInflate->In[pInflate->nIn], data, nBytes);
+	pInflate->nIn += nBytes;
+
+	while (pInflate->nIn >= COMPRESS_HEADER) {
+		memcpy(&u32, pInflate->In, 4);
+		nStored = ntohl(u32) & ~COMPRESS_RAW;
+		memcpy(&u32, &pInflate->In[4], 4);
+		nRaw = ntohl(u32);
+		if (nStored > COMPRESS_BLOCK || nRaw > COMPRESS_BLOCK)
+			return DropBlock(pInflate, nStored, nRaw);
+		if (pInflate->nIn < COMPRESS_HEADER + nStored)
+			break;
+		memcpy(&u32, pInflate->In, 4);
+		if (ntohl(u32) & COMPRESS_RAW)
+			memcpy(pInflate->Out, &pInflate->In[COMPRESS_HEADER], nRaw);
+		else {
+#ifdef HAVE_ZLIB
+			nOut = nRaw;
+			if (Z_OK != uncompress(pInflate->Out, &nOut, &pInflate->In[COMPRESS_HEADER], nStored) 
+			    || nOut != nRaw)
+				return DropBlock(pInflate, nStored, nRaw);
+#else
+			Debug(0, "Compressed data, but osg was built without zlib\n");
+			return false;
+#endif
+		}
+		pInflate->nIn -= COMPRESS_HEADER + nStored;
+		memmove(pInflate->In, &pInflate->In[COMPRESS_HEADER + nStored], pInflate->nIn);
+
+		for (done = 0; done < nRaw; done += n) {
+			n = nRaw - done < 32768 ? nRaw - done : 32768;
+			if (NULL != pInflate->Queue) {
+				if (NULL == (slot = FrameQueueReserve(pInflate->Queue)))
+					return false;
+				memcpy(slot, &pInflate->Out[done], n);
+				FrameQueueCommit(pInflate->Queue, n);
+			} else if (!OutputCommit(pInflate->Output, &pInflate->Out[done], n))
+				return false;
+		}
+		pInflate->nBytes += nRaw;
+	}
+	return true;
+}
+
+//***********************************************
+// Tape catalog (-c) and restore of single files from it (-F)
+
+CATALOG_ENTRY* CatalogAdd(CATALOG *pCatalog) 
+{
+	CATALOG_ENTRY *pEntry;
+
+	pCatalog->Entries = (CATALOG_ENTRY *) realloc(pCatalog->Entries, 
+				(pCatalog->nEntries + 1) * sizeof(CATALOG_ENTRY));
+	if (NULL == pCatalog->Entries) {
+		Debug(0, "CatalogAdd: fatal: realloc() returned NULL\n");
+		abort();
+	}
+	pEntry = &pCatalog->Entries[pCatalog->nEntries++];
+	memset(pEntry, 0, sizeof(*pEntry));
+	return pEntry;
+}
+
+//***********************************************
+// ReadFrameAt: locate to a frame and read it
+// Outputs: true if the frame could be read, its AUX in *pAux
+bool ReadFrameAt(OnStream *pOnStream, UINT32 nFrame, unsigned char *buf, AUX_FRAME *pAux) 
+{
+	if (false == pOnStream->Locate(nFrame)) 
+		return false;
+	WaitForReady(pOnStream);
+	if (false == pOnStream->StartRead())
+		return false;
+	WaitForReady(pOnStream);
+	if (false == pOnStream->Read(buf) || SNoSense != CheckSense(pOnStream))
+		return false;
+	unFormatAuxFrame(&buf[32768], pAux);
+	return true;
+}
+
+//***********************************************
+// HeaderEOD: find the EOD frame the ADR header frames point to
+// (partition[0].eod_frame_ppos of the ADR 1.2 header) and read it
+// Inputs:  header frame, write pass of the tape, first user frame
+// Outputs: false if there is no EOD frame of this write pass there;
+//          else its position and AUX, which carries the sequence
+//          number, LBA and filemark count to go on with
+bool HeaderEOD(OnStream *pOnStream, unsigned char *header, unsigned int WritePass, 
+	       UINT32 StartFrame, UINT32 *pEOD, AUX_FRAME *pAux) 
+{
+	unsigned char buf[33280];
+
+	*pEOD = (header[32] << 24) | (header[33] << 16) | (header[34] << 8) | header[35];
+	if (*pEOD < StartFrame || !ReadFrameAt(pOnStream, *pEOD, buf, pAux))
+		return false;
+	return pAux->FrameType == 0x0100 
+		&& pAux->PartitionDescription.WritePassCounter == WritePass;
+}
+
+//***********************************************
+// CatalogFromHeader: build the catalog from the filemark table and EOD
+// position the osst driver keeps in the ADR header frames. Only the
+// first frame of the tape, the marker frames and EOD need to be read.
+// Inputs:  header frame, first user frame, catalog to fill
+// Outputs: false if the header does not carry a usable filemark table
+bool CatalogFromHeader(OnStream *pOnStream, unsigned char *header, UINT32 StartFrame, CATALOG *pCatalog) 
+{
+	unsigned char buf[33280];
+	UINT32 eod, mark, prev, first;
+	unsigned int nMarks, counter;
+	AUX_FRAME Aux, EODAux;
+	CATALOG_ENTRY *pEntry;
+
+	/* dat_fm_tab of the ADR 1.2 header */
+	nMarks = (header[17736 + 4] << 8) | header[17736 + 5];
+	if (nMarks > FM_TAB_MAX 
+	    || !HeaderEOD(pOnStream, header, pCatalog->WritePass, StartFrame, &eod, &EODAux) 
+	    || (0 == nMarks && eod == StartFrame))
+		return false;
+	for (counter = 0, prev = StartFrame; counter < nMarks; counter++) {
+		mark = ntohl(*((unsigned int *) &header[17736 + 16 + 4 * counter]));
+		if (mark < prev || mark >= eod)
+			return false;
+		prev = mark + 1;
+	}
+	Debug(2, "Building catalog from header: %d filemarks, EOD at %d\n", nMarks, eod);
+
+	first = StartFrame;
+	for (counter = 0; counter < nMarks; counter++) {
+		mark = ntohl(*((unsigned int *) &header[17736 + 16 + 4 * counter]));
+		pEntry = CatalogAdd(pCatalog);
+		pEntry->FirstFrame = first;
+		pEntry->LastFrame  = mark > first ? mark - 1 : first;
+		/* The marker carries the sequence number and LBA following the file */
+		if (!ReadFrameAt(pOnStream, mark, buf, &Aux) || Aux.FrameType != 0x0200)
+			return false;
+		pEntry->EndSeq = Aux.FrameSequenceNumber;
+		pEntry->EndLBA = Aux.LogicalBlockAddress;
+		if (counter > 0) {
+			pEntry->FirstSeq = pEntry[-1].EndSeq + 1;
+			pEntry->FirstLBA = pEntry[-1].EndLBA + 1;
+		} else if (mark > first) {
+			if (!ReadFrameAt(pOnStream, first, buf, &Aux))
+				return false;
+			pEntry->FirstSeq = Aux.FrameSequenceNumber;
+			pEntry->FirstLBA = Aux.LogicalBlockAddress;
+		}
+		first = mark + 1;
+	}
+	/* A file after the last filemark ends at EOD (there is none if the
+	 * frame after the mark is one of the second config area) */
+	if (first < eod) {
+		if (!ReadFrameAt(pOnStream, first, buf, &Aux))
+			return false;
+		if (Aux.FrameType == 0x8000) {
+			pEntry = CatalogAdd(pCatalog);
+			pEntry->FirstFrame = first;
+			pEntry->LastFrame  = eod - 1;
+			pEntry->FirstSeq   = Aux.FrameSequenceNumber;
+			pEntry->FirstLBA   = Aux.LogicalBlockAddress;
+			pEntry->EndSeq     = EODAux.FrameSequenceNumber;
+			pEntry->EndLBA     = EODAux.LogicalBlockAddress;
+		}
+	}
+	return true;
+}
+
+//***********************************************
+// CatalogScan: build the catalog by reading the tape once, from StartFrame
+// to EOD. Files are separated by marker frames.
+bool CatalogScan(OnStream *pOnStream, READAHEAD *pReadAhead, unsigned char *buf, 
+		 UINT32 StartFrame, CATALOG *pCatalog) 
+{
+	UINT32 CurrentFrame = StartFrame;
+	unsigned char *frame;
+	CATALOG_ENTRY *pEntry = NULL;
+	AUX_FRAME Aux;
+	unsigned long NextSeq = 0;
+	unsigned int retry = 0;
+	bool eof = false, relocate = true;
+
+	Debug(2, "Scanning tape for catalog from frame %d\n", StartFrame);
+	while (!eof && !signalled) {
+		if (relocate) {
+			CancelReadAhead(pOnStream, pReadAhead);
+			if (false == pOnStream->Locate(CurrentFrame) 
+			    || false == pOnStream->StartRead())
+				return false;
+			WaitForReady(pOnStream);
+			relocate = false;
+		}
+		if (NULL == (frame = ReadFrame(pOnStream, pReadAhead, buf)))
+			return false;
+		switch (CheckSense(pOnStream)) {
+		case SNoSense:
+			break;
+		case SUnrecoveredReadError:
+			Debug(2, "Catalog: read error at frame %d, skipping\n", CurrentFrame);
+			CurrentFrame++;
+			relocate = true;
+			continue;
+		case SEOD:
+			/* As in the read loop: there may be data behind a write error skip */
+			if (retry++ > 5)
+				eof = true;
+			CurrentFrame += 5;
+			relocate = true;
+			continue;
+		default:
+			return false;
+		}
+		unFormatAuxFrame(&frame[32768], &Aux);
+		switch (Aux.FrameType) {
+		case 0x8000:
+			retry = 0;
+			if (Aux.PartitionDescription.WritePassCounter != pCatalog->WritePass
+			    || (pEntry && Aux.FrameSequenceNumber < NextSeq))
+				break;
+			if (NULL == pEntry) {
+				pEntry = CatalogAdd(pCatalog);
+				pEntry->FirstFrame = CurrentFrame;
+				pEntry->FirstSeq   = Aux.FrameSequenceNumber;
+				pEntry->FirstLBA   = Aux.LogicalBlockAddress;
+			}
+			pEntry->LastFrame = CurrentFrame;
+			pEntry->EndSeq    = NextSeq = Aux.FrameSequenceNumber + 1;
+			pEntry->EndLBA    = Aux.LogicalBlockAddress 
+				+ Aux.DataAccessTable.DataAccessTableEntry[0].LogicalElements;
+			break;
+		case 0x0200:
+			Debug(3, "Catalog: filemark at frame %d\n", CurrentFrame);
+			pEntry = NULL;
+			break;
+		case 0x0100:
+			if (!retry && Aux.PartitionDescription.WritePassCounter == pCatalog->WritePass)
+				eof = true;
+			break;
+		}
+		CurrentFrame++;
+	}
+	CancelReadAhead(pOnStream, pReadAhead);
+	return !signalled;
+}
+
+bool SaveCatalog(const char *filename, CATALOG *pCatalog) 
+{
+	FILE *fIndex;
+	unsigned int counter;
+	CATALOG_ENTRY *pEntry;
+
+	if (NULL == filename)
+		fIndex = stdout;
+	else if (NULL == (fIndex = fopen(filename, "w"))) {
+		Debug(0, "Can't open index file %s - Error %s\n", filename, strerror(errno));
+		return false;
+	}
+	fprintf(fIndex, "# osg %s index, write pass %u\n", VERSION, pCatalog->WritePass);
+	fprintf(fIndex, "# file first_frame last_frame first_seq end_seq first_lba end_lba\n");
+	for (counter = 0; counter < pCatalog->nEntries; counter++) {
+		pEntry = &pCatalog->Entries[counter];
+		fprintf(fIndex, "%u %lu %lu %lu %lu %Lu %Lu\n", counter, 
+			pEntry->FirstFrame, pEntry->LastFrame, pEntry->FirstSeq, pEntry->EndSeq,
+			pEntry->FirstLBA, pEntry->EndLBA);
+	}
+	if (NULL != filename)
+		fclose(fIndex);
+	return true;
+}
+
+bool LoadCatalog(const char *filename, CATALOG *pCatalog) 
+{
+	FILE *fIndex;
+	char line[256];
+	unsigned int number;
+	CATALOG_ENTRY Entry;
+
+	if (NULL == (fIndex = fopen(filename, "r"))) {
+		Debug(0, "Can't open index file %s - Error %s\n", filename, strerror(errno));
+		return false;
+	}
+	while (fgets(line, sizeof(line), fIndex)) {
+		if (sscanf(line, "# osg %*s index, write pass %u", &pCatalog->WritePass) == 1)
+			continue;
+		if ('#' == line[0])
+			continue;
+		if (sscanf(line, "%u %lu %lu %lu %lu %Lu %Lu", &number, 
+			   &Entry.FirstFrame, &Entry.LastFrame, &Entry.FirstSeq, &Entry.EndSeq,
+			   &Entry.FirstLBA, &Entry.EndLBA) != 7 || number != pCatalog->nEntries) {
+			Debug(0, "Bad line in index file %s: %s", filename, line);
+			fclose(fIndex);
+			return false;
+		}
+		*CatalogAdd(pCatalog) = Entry;
+	}
+	fclose(fIndex);
+	return true;
+}
+
+//***********************************************
+// SaveCheckpoint: replace the checkpoint file, so that there always is
+// a complete one, even after a crash
+bool SaveCheckpoint(const char *filename, CHECKPOINT *pCheckpoint) 
+{
+	FILE *fCheckpoint;
+	char tmpname[1024];
+
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
+	if (NULL == (fCheckpoint = fopen(tmpname, "w"))) {
+		Debug(0, "Can't open checkpoint file %s - Error %s\n", tmpname, strerror(errno));
+		return false;
+	}
+	fprintf(fCheckpoint, "# osg %s checkpoint, write pass %u\n", VERSION, pCheckpoint->WritePass);
+	fprintf(fCheckpoint, "# frames last_frame last_lba input_offset\n");
+	fprintf(fCheckpoint, "%lu %lu %Lu %Lu\n", pCheckpoint->nFrames, pCheckpoint->Frame, 
+		pCheckpoint->LBA, pCheckpoint->Offset);
+	if (fflush(fCheckpoint) || fsync(fileno(fCheckpoint)) || fclose(fCheckpoint) 
+	    || rename(tmpname, filename)) {
+		Debug(0, "Can't write checkpoint file %s - Error %s\n", filename, strerror(errno));
+		return false;
+	}
+	Debug(3, "Checkpoint: %lu frames, last at %lu\n", pCheckpoint->nFrames, pCheckpoint->Frame);
+	return true;
+}
+
+bool LoadCheckpoint(const char *filename, CHECKPOINT *pCheckpoint) 
+{
+	FILE *fCheckpoint;
+	char line[256];
+	bool found = false;
+
+	if (NULL == (fCheckpoint = fopen(filename, "r"))) {
+		Debug(0, "Can't open checkpoint file %s - Error %s\n", filename, strerror(errno));
+		return false;
+	}
+	memset(pCheckpoint, 0, sizeof(CHECKPOINT));
+	while (fgets(line, sizeof(line), fCheckpoint)) {
+		if (sscanf(line, "# osg %*s checkpoint, write pass %u", &pCheckpoint->WritePass) == 1)
+			continue;
+		if ('#' == line[0])
+			continue;
+		if (sscanf(line, "%lu %lu %Lu %Lu", &pCheckpoint->nFrames, &pCheckpoint->Frame, 
+			   &pCheckpoint->LBA, &pCheckpoint->Offset) != 4) {
+			Debug(0, "Bad line in checkpoint file %s: %s", filename, line);
+			fclose(fCheckpoint);
+			return false;
+		}
+		found = true;
+	}
+	fclose(fCheckpoint);
+	if (!found)
+		Debug(0, "No checkpoint in %s\n", filename);
+	return found;
+}
+
+//***********************************************
+// UpdateCheckpoint: note the frames the drive has on tape by now. Those
+// we still hold a shadow copy of may not be.
+// Inputs:  next frame to write, sequence number and LBA for it; force:
+//          save even if less than CHECKPOINT_FRAMES frames were added
+void UpdateCheckpoint(const char *filename, CHECKPOINT *pCheckpoint, UINT32 CurrentFrame, 
+		      unsigned long NextSeq, unsigned long long NextLBA, UINT32 second_cfg, 
+		      bool force) 
+{
+	unsigned long nFrames;
+
+	/* Header frames may still be among the shadow copies at first */
+	if (NextSeq <= TotalBufferedFrames)
+		return;
+	nFrames = NextSeq - TotalBufferedFrames;
+	if (nFrames < pCheckpoint->nFrames + (force ? 1 : CHECKPOINT_FRAMES))
+		return;
+	pCheckpoint->nFrames = nFrames;
+	pCheckpoint->Frame = CurrentFrame - TotalBufferedFrames - 1;
+	if (CurrentFrame >= 0xBB8 && pCheckpoint->Frame < 0xBB8)
+		pCheckpoint->Frame -= 0xBB8 - second_cfg;
+	pCheckpoint->LBA = NextLBA - TotalBufferedFrames - 1;
+	pCheckpoint->Offset = (unsigned long long) nFrames * 32768;
+	SaveCheckpoint(filename, pCheckpoint);
+}
+
+//***********************************************
+// SkipInput: skip what is on tape already when resuming. A pipe has to
+// deliver the same data again, we read over it.
+bool SkipInput(FILE *fFile, unsigned long long nBytes) 
+{
+	char skipbuf[32768];
+	size_t n;
+
+	if (0 == nBytes || 0 == fseeko(fFile, nBytes, SEEK_SET))
+		return true;
+	if (ESPIPE != errno)
+		return false;
+	while (nBytes > 0) {
+		n = nBytes < sizeof(skipbuf) ? nBytes : sizeof(skipbuf);
+		if (fread(skipbuf, 1, n, fFile) != n)
+			return false;
+		nBytes -= n;
+	}
+	return true;
+}
+
+//***********************************************
+// ResumeWrite: check the tape against a checkpoint and find where to go
+// on writing. The input is read 4 frames at a time, so we go on after a
+// frame numbered 4n-1 (or at the start).
+// Inputs:  checkpoint, write pass and frames of the tape layout
+// Outputs: false if the tape does not match the checkpoint; else the
+//          frame to write next and its sequence number (= LBA = input
+//          offset / 32768)
+bool ResumeWrite(OnStream *pOnStream, READAHEAD *pReadAhead, CHECKPOINT *pCheckpoint, 
+		 unsigned int WritePass, UINT32 StartFrame, UINT32 second_cfg, 
+		 UINT32 *pFrame, unsigned long *pSeqNo) 
+{
+	unsigned char buf[33280], *frame = NULL;
+	unsigned long Want, back, SeqNo;
+	UINT32 Position, Frame;
+	AUX_FRAME Aux;
+
+	if (pCheckpoint->WritePass != WritePass) {
+		Debug(0, "Checkpoint is for write pass %u, the tape was last written in pass %u\n", 
+		      pCheckpoint->WritePass, WritePass);
+		return false;
+	}
+	*pFrame = StartFrame;
+	*pSeqNo = 0;
+	if (pCheckpoint->nFrames < 4)
+		return true;
+
+	Want = (pCheckpoint->nFrames & ~3UL) - 1;
+	back = pCheckpoint->nFrames - 1 - Want;
+	/* A frame can't be closer to the start than its sequence number */
+	Frame = pCheckpoint->Frame - back;
+	if (Frame < StartFrame + Want)
+		Frame = StartFrame + Want;
+	if (!FindLogicalFrame(pOnStream, pReadAhead, buf, WritePass, Want, StartFrame + Want, 
+			      Frame, &frame, &Position, &SeqNo) 
+	    || SeqNo != Want) {
+		Debug(0, "Frame %lu of the checkpoint not found on tape\n", Want);
+		CancelReadAhead(pOnStream, pReadAhead);
+		return false;
+	}
+	unFormatAuxFrame(&frame[32768], &Aux);
+	CancelReadAhead(pOnStream, pReadAhead);
+	if (Aux.FrameType != 0x8000 || Aux.LogicalBlockAddress != pCheckpoint->LBA - back) {
+		Debug(0, "Frame %lu at %lu does not match the checkpoint\n", Want, Position);
+		return false;
+	}
+	Debug(1, "Resuming after frame %lu at %lu\n", Want, Position);
+	*pFrame = Position + 1 == second_cfg ? 0xBB8 : Position + 1;
+	*pSeqNo = Want + 1;
+	return true;
+}
+
+void AddFrameToBuffer(TAPEBUFFER **LastBuffer, void *buf) 
+{
+	TAPEBUFFER *ThisTapeBuffer;
+
+	Debug(6, "Adding 1 frame to tape buffer\n");
+	ThisTapeBuffer = (TAPEBUFFER *) malloc(sizeof(TAPEBUFFER));
+	ThisTapeBuffer->Next = NULL;
+	/* If all frames have been deleted, *LastBuffer is gone as well */
+	if (TapeBuffer == NULL || 0 == TotalBufferedFrames)
+		TapeBuffer = ThisTapeBuffer;
+	else
+		(*LastBuffer)->Next = ThisTapeBuffer;
 
 	ThisTapeBuffer->Frame = (unsigned char *) malloc(33280);
 	memcpy(ThisTapeBuffer->Frame, buf, 33280);
 	TotalBufferedFrames++;
 	Debug(6, "Total: %d buffered frames\n", TotalBufferedFrames);
 
-	*LastBuffer = ThisTapeBuffer;
+	*LastBuffer = ThisTapeBuffer;
+}
+
+//***********************************************
+// WriteConfigFrames: write the five copies of the ADR header frame,
+// at 5 or second_cfg
+// Outputs: false if a command failed
+bool WriteConfigFrames(OnStream *pOnStream, unsigned char *buf, UINT32 First, bool flush, 
+		       TAPEBUFFER **pLastTapeBuffer, unsigned int *pCurrentTapeBuffer) 
+{
+	UINT32 Frame;
+
+	if (false == pOnStream->Locate(First, flush)) {
+		Debug(0, "main: Locate failed: '%s'\n", szOnStreamErrors[pOnStream->GetLastError()]);
+		return false;
+	}
+	WaitForReady(pOnStream);
+
+	for (Frame = First; Frame < First + 5; Frame++) {
+		if (false == pOnStream->Write(buf, 33280)) {
+			Debug(0, "main: write failed: '%s'\n", szOnStreamErrors[pOnStream->GetLastError()]);
+			return false;
+		}
+		AddFrameToBuffer(pLastTapeBuffer, buf);
+		CheckWrittenFrames(pOnStream, &TapeBuffer, 1, pCurrentTapeBuffer);
+	}
+	pOnStream->Flush();
+	WaitForReady(pOnStream);
+	if (OS_NEED_POLL(pOnStream->FWRev()))
+	    pOnStream->WaitPosition(Frame, 100, 1);
+	return true;
+}
+
+//***********************************************
+// UpdateHeader: put the EOD position and the filemark table of what was
+// written into the header frames, the way the osst driver keeps them
+// (see CatalogFromHeader), and write them again
+bool UpdateHeader(OnStream *pOnStream, unsigned char *header, UINT32 eod, FILEMARKS *pMarks, 
+		  UINT32 second_cfg, TAPEBUFFER **pLastTapeBuffer, unsigned int *pCurrentTapeBuffer) 
+{
+	unsigned int counter, nMarks, u32;
+	unsigned short u16;
+	AUX_FRAME Aux;
+
+	/* A table too long to keep is left empty */
+	nMarks = pMarks->nMarks > FM_TAB_MAX ? 0 : pMarks->nMarks;
+	u32 = htonl(eod);
+	memcpy(&header[32], &u32, 4);
+	memset(&header[17736], 0, 16 + 4 * FM_TAB_MAX);
+	header[17736 + 2] = 4;
+	u16 = htons(nMarks);
+	memcpy(&header[17736 + 4], &u16, 2);
+	for (counter = 0; counter < nMarks; counter++) {
+		u32 = htonl(pMarks->Frames[counter]);
+		memcpy(&header[17736 + 16 + 4 * counter], &u32, 4);
+	}
+	unFormatAuxFrame(&header[32768], &Aux);
+	Aux.UpdateFrameCounter++;
+	Aux.LastMarkFrameAddress = nMarks ? pMarks->Frames[nMarks - 1] : 0xFFFFFFFF;
+	FormatAuxFrame(Aux, &header[32768]);
+
+	Debug(2, "Updating header frames: EOD at %lu, %u filemarks\n", eod, nMarks);
+	return WriteConfigFrames(pOnStream, header, 5, true, pLastTapeBuffer, pCurrentTapeBuffer)
+	    && WriteConfigFrames(pOnStream, header, second_cfg, true, pLastTapeBuffer, pCurrentTapeBuffer);
+}
+
+//***********************************************
+// FindAppendPoint: where to go on writing a tape (-a). That is at the
+// EOD frame the header points to; the filemarks before it are kept.
+// Inputs:  header frame, write pass of the tape, first user frame
+// Outputs: false if the header has no EOD of this write pass; else the
+//          EOD frame, its AUX and the filemark table
+bool FindAppendPoint(OnStream *pOnStream, unsigned char *header, unsigned int WritePass, 
+		     UINT32 StartFrame, FILEMARKS *pMarks, UINT32 *pFrame, AUX_FRAME *pAux) 
+{
+	unsigned int counter, u32;
+
+	if (!HeaderEOD(pOnStream, header, WritePass, StartFrame, pFrame, pAux)) {
+		Debug(0, "No EOD of write pass %u in the header frames, can't append\n", WritePass);
+		return false;
+	}
+	pMarks->nMarks = (header[17736 + 4] << 8) | header[17736 + 5];
+	if (pMarks->nMarks > FM_TAB_MAX) {
+		Debug(0, "Filemark table in the header frames is too long, can't append\n");
+		return false;
+	}
+	for (counter = 0; counter < pMarks->nMarks; counter++) {
+		memcpy(&u32, &header[17736 + 16 + 4 * counter], 4);
+		pMarks->Frames[counter] = ntohl(u32);
+	}
+	Debug(1, "Appending at frame %lu after %lu frames, %u filemarks\n", *pFrame, 
+	      pAux->FrameSequenceNumber, pMarks->nMarks);
+	return true;
+}
+
+/* Command latencies collected by the benchmark (-b) */
+struct LATENCY {
+	const char    *Name;
+	unsigned long *Samples;	/* us */
+	unsigned long  nSamples;
+	unsigned long  nAlloc;
+};
+
+/* Throughput and drive buffer fill of one benchmark phase */
+struct BENCHPHASE {
+	const char    *Name;
+	double         Start;
+	double         LastReport;
+	unsigned long  Frames;
+	unsigned long  LastFrames;
+	unsigned int   BufferMax;
+	unsigned int   BufferMin;
+	unsigned int   BufferPeak;
+	unsigned long  BufferSum;
+	unsigned long  BufferSamples;
+};
+
+static double Seconds(void) 
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+void LatencyAdd(LATENCY *pLatency, double Start) 
+{
+	if (pLatency->nSamples == pLatency->nAlloc) {
+		pLatency->nAlloc = pLatency->nAlloc ? 2 * pLatency->nAlloc : 1024;
+		pLatency->Samples = (unsigned long *) realloc(pLatency->Samples, 
+			pLatency->nAlloc * sizeof(unsigned long));
+		if (NULL == pLatency->Samples) {
+			Debug(0, "LatencyAdd: fatal: realloc() returned NULL\n");
+			abort();
+		}
+	}
+	pLatency->Samples[pLatency->nSamples++] = (unsigned long) ((Seconds() - Start) * 1000000);
+}
+
+static int CompareSamples(const void *a, const void *b) 
+{
+	unsigned long x = *(const unsigned long *) a, y = *(const unsigned long *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+void LatencyReport(LATENCY *pLatency) 
+{
+	unsigned long n = pLatency->nSamples;
+	unsigned long *p = pLatency->Samples;
+
+	if (0 == n) {
+		printf("%-14s %8d\n", pLatency->Name, 0);
+		return;
+	}
+	qsort(p, n, sizeof(unsigned long), CompareSamples);
+	printf("%-14s %8lu %10.3f %10.3f %10.3f %10.3f\n", pLatency->Name, n, 
+	       p[(n - 1) * 50 / 100] / 1000.0, p[(n - 1) * 90 / 100] / 1000.0, 
+	       p[(n - 1) * 99 / 100] / 1000.0, p[n - 1] / 1000.0);
+	free(p);
+	pLatency->Samples = NULL;
+	pLatency->nSamples = pLatency->nAlloc = 0;
+}
+
+//***********************************************
+// BenchProgress: count a frame, sample the drive buffer every
+// BUFFER_SAMPLE_FRAMES frames and print the throughput once a second
+void BenchProgress(OnStream *pOnStream, BENCHPHASE *pPhase, UINT32 Frame, 
+		   LATENCY *pPosition) 
+{
+	unsigned int MaxBuffer, CurrentBuffer;
+	double now, t;
+
+	pPhase->Frames++;
+	if (pPhase->Frames % BUFFER_SAMPLE_FRAMES)
+		return;
+
+	pOnStream->BufferStatus(&MaxBuffer, &CurrentBuffer);
+	if (CurrentBuffer <= MaxBuffer) {
+		pPhase->BufferMax = MaxBuffer;
+		if (0 == pPhase->BufferSamples || CurrentBuffer < pPhase->BufferMin)
+			pPhase->BufferMin = CurrentBuffer;
+		if (CurrentBuffer > pPhase->BufferPeak)
+			pPhase->BufferPeak = CurrentBuffer;
+		pPhase->BufferSum += CurrentBuffer;
+		pPhase->BufferSamples++;
+	}
+
+	now = Seconds();
+	if (now - pPhase->LastReport < 1.0)
+		return;
+	t = Seconds();
+	pOnStream->ReadPosition();
+	LatencyAdd(pPosition, t);
+	printf("%7.1fs %-5s frame %7lu %8.2f MB/s  buffer %3u/%u\n", now - pPhase->Start, 
+	       pPhase->Name, Frame, 
+	       (pPhase->Frames - pPhase->LastFrames) * 32768.0 / 1048576.0 / (now - pPhase->LastReport), 
+	       CurrentBuffer, MaxBuffer);
+	fflush(stdout);
+	pPhase->LastReport = now;
+	pPhase->LastFrames = pPhase->Frames;
+}
+
+void BenchPhaseReport(BENCHPHASE *pPhase, double End) 
+{
+	printf("%-5s %8lu frames in %.1fs, %.2f MB/s", pPhase->Name, pPhase->Frames, 
+	       End - pPhase->Start, 
+	       pPhase->Frames * 32768.0 / 1048576.0 / (End > pPhase->Start ? End - pPhase->Start : 1));
+	if (pPhase->BufferSamples)
+		printf(", drive buffer min %u avg %.1f max %u of %u", pPhase->BufferMin, 
+		       (double) pPhase->BufferSum / pPhase->BufferSamples, pPhase->BufferPeak, 
+		       pPhase->BufferMax);
+	printf("\n");
+}
+
+//***********************************************
+// BenchFrame: fill a frame with a pattern that tells the run and the
+// sequence number, or check one. The pattern differs in every word.
+void BenchFrame(unsigned char *buf, unsigned int RunID, unsigned int SeqNo) 
+{
+	unsigned int *p = (unsigned int *) buf;
+	unsigned int counter;
+
+	p[0] = RunID;
+	p[1] = SeqNo;
+	for (counter = 2; counter < 32768 / sizeof(unsigned int); counter++)
+		p[counter] = RunID + SeqNo * 2654435761U + counter;
+}
+
+bool BenchCheck(unsigned char *buf, unsigned int RunID, unsigned int SeqNo) 
+{
+	unsigned int *p = (unsigned int *) buf;
+	unsigned int counter;
+
+	for (counter = 2; counter < 32768 / sizeof(unsigned int); counter++)
+		if (p[counter] != RunID + SeqNo * 2654435761U + counter)
+			return false;
+	return p[0] == RunID && p[1] == SeqNo;
+}
+
+//***********************************************
+// BenchLocate: timed Locate, followed by StartRead when reading
+// (pReadAhead set, its frames are dropped first)
+bool BenchLocate(OnStream *pOnStream, UINT32 Frame, LATENCY *pLocate, READAHEAD *pReadAhead) 
+{
+	double t;
+	bool ok;
+
+	if (NULL != pReadAhead)
+		CancelReadAhead(pOnStream, pReadAhead);
+	t = Seconds();
+	ok = pOnStream->Locate(Frame, NULL == pReadAhead);
+	LatencyAdd(pLocate, t);
+	if (ok && NULL != pReadAhead)
+		ok = pOnStream->StartRead();
+	if (!ok) {
+		Debug(0, "Benchmark: Locate failed: '%s'\n", szOnStreamErrors[pOnStream->GetLastError()]);
+		return false;
+	}
+	WaitForReady(pOnStream);
+	return true;
+}
+
+/* The benchmark keeps off both config areas, old and new */
+#define BENCH_SKIP_FIRST 0xBAE
+#define BENCH_SKIP_END   0xBB8
+
+//***********************************************
+// Benchmark: write synthetic frames to First..Last, read them back and
+// report throughput, latency percentiles of the frame and positioning
+// commands, drive buffer fill and error recoveries.
+// Whatever was on tape in that range is lost.
+// Outputs: 0 if both passes completed, 1 otherwise
+int Benchmark(OnStream *pOnStream, UINT32 First, UINT32 Last, 
+	      unsigned int *CurrentTapeBuffer, READAHEAD *pReadAhead) 
+{
+	LATENCY Write = { "WRITE" }, Read = { "READ" }, 
+		Position = { "READ_POSITION" }, Locate = { "LOCATE" };
+	BENCHPHASE WritePhase = { "write" }, ReadPhase = { "read" };
+	TAPEBUFFER *LastTapeBuffer = NULL;
+	struct AUX_FRAME AuxFrame;
+	unsigned char buf[33280], *frame;
+	unsigned int RunID = (unsigned int) time(NULL) ^ (getpid() << 16);
+	unsigned int SeqNo = 0, Written, Recoveries = 0, ReadErrors = 0;
+	unsigned int Lost = 0, Stale = 0, Bad = 0;
+	UINT32 Frame = First;
+	unsigned int skip;
+	char sense[16];
+	bool ok, retry = false;
+	double t;
+
+	printf("Benchmark: frames %lu-%lu, run %08x%s\n", First, Last, RunID, 
+	       pOnStream->Emulated() ? ", emulated drive" : "");
+
+	memset(&AuxFrame, 0, sizeof(AuxFrame));
+	memcpy(&AuxFrame.ApplicationSig, VENDORID, 4);
+	AuxFrame.FrameType = 0x8000;
+	AuxFrame.PartitionDescription.WritePassCounter = 0xFFFF;
+	AuxFrame.PartitionDescription.FirstFrameAddress = First;
+	AuxFrame.PartitionDescription.LastFrameAddress = Last;
+	AuxFrame.DataAccessTable.nEntries = 0x01;
+	AuxFrame.DataAccessTable.DataAccessTableEntry[0].size = 32768;
+	AuxFrame.DataAccessTable.DataAccessTableEntry[0].LogicalElements = 1;
+	AuxFrame.DataAccessTable.DataAccessTableEntry[0].flags = 0xC;
+	AuxFrame.LastMarkFrameAddress = 0xFFFFFFFF;
+
+	if (!BenchLocate(pOnStream, Frame, &Locate, NULL))
+		return 1;
+
+	WritePhase.Start = WritePhase.LastReport = Seconds();
+	while (Frame <= Last && !signalled) {
+		if (Frame >= BENCH_SKIP_FIRST && Frame < BENCH_SKIP_END) {
+			Frame = BENCH_SKIP_END;
+			if (!BenchLocate(pOnStream, Frame, &Locate, NULL))
+				return 1;
+			continue;
+		}
+		if (!retry) {
+			BenchFrame(buf, RunID, SeqNo);
+			AuxFrame.FrameSequenceNumber = SeqNo;
+			AuxFrame.LogicalBlockAddress = SeqNo;
+			FormatAuxFrame(AuxFrame, &buf[32768]);
+		}
+		t = Seconds();
+		ok = pOnStream->Write(buf, 33280);
+		LatencyAdd(&Write, t);
+		if (!ok) {
+			Debug(0, "Benchmark: write failed: '%s'\n", szOnStreamErrors[pOnStream->GetLastError()]);
+			return 1;
+		}
+		switch (CheckSense(pOnStream)) {
+		case SNoSense:
+			retry = false;
+			AddFrameToBuffer(&LastTapeBuffer, buf);
+			SeqNo++;
+			Frame++;
+			NoteWrittenFrames(pOnStream, &TapeBuffer, 1, CurrentTapeBuffer);
+			BenchProgress(pOnStream, &WritePhase, Frame, &Position);
+			break;
+		case SMediumWriteError:
+			Recoveries++;
+			pOnStream->GetLastSense(sense);
+			skip = (unsigned int) (unsigned char) sense[9];
+			if (!skip) skip = 80;
+			if ((skip = pOnStream->SkipLocate(skip))) Frame = skip;
+			else Frame += RequeueData(pOnStream, &TapeBuffer, 0, CurrentTapeBuffer, 80);
+			retry = true;
+			break;
+		default:
+			Debug(0, "Benchmark: write error at frame %lu\n", Frame);
+			return 1;
+		}
+	}
+	pOnStream->Flush();
+	WaitForWrite(pOnStream, &TapeBuffer, CurrentTapeBuffer, 0);
+	WaitForReady(pOnStream);
+	DeleteFrames(&TapeBuffer, TotalBufferedFrames);
+	BenchPhaseReport(&WritePhase, Seconds());
+	Written = SeqNo;
+
+	/* Read it all back */
+	Frame = First;
+	SeqNo = 0;
+	if (!BenchLocate(pOnStream, Frame, &Locate, pReadAhead))
+		return 1;
+
+	ReadPhase.Start = ReadPhase.LastReport = Seconds();
+	while (SeqNo < Written && !signalled) {
+		if (Frame >= BENCH_SKIP_FIRST && Frame < BENCH_SKIP_END) {
+			Frame = BENCH_SKIP_END;
+			if (!BenchLocate(pOnStream, Frame, &Locate, pReadAhead))
+				return 1;
+			continue;
+		}
+		t = Seconds();
+		frame = ReadFrame(pOnStream, pReadAhead, buf);
+		LatencyAdd(&Read, t);
+		if (NULL == frame) {
+			Debug(0, "Benchmark: read failed: '%s'\n", szOnStreamErrors[pOnStream->GetLastError()]);
+			return 1;
+		}
+		switch (CheckSense(pOnStream)) {
+		case SNoSense:
+			break;
+		case SUnrecoveredReadError:
+			ReadErrors++;
+			if (!BenchLocate(pOnStream, ++Frame, &Locate, pReadAhead))
+				return 1;
+			continue;
+		case SEOD:
+			Debug(0, "Benchmark: end of data at frame %lu\n", Frame);
+			Lost += Written - SeqNo;
+			SeqNo = Written;
+			continue;
+		default:
+			Debug(0, "Benchmark: read error at frame %lu\n", Frame);
+			return 1;
+		}
+		Frame++;
+		unFormatAuxFrame(&frame[32768], &AuxFrame);
+		if (AuxFrame.FrameType != 0x8000 || *(unsigned int *) frame != RunID
+		    || ((unsigned int *) frame)[1] < SeqNo) {
+			/* Left over from before, e.g. in the frames skipped after
+			 * a write error */
+			Stale++;
+			continue;
+		}
+		if (((unsigned int *) frame)[1] > SeqNo) {
+			Lost += ((unsigned int *) frame)[1] - SeqNo;
+			SeqNo = ((unsigned int *) frame)[1];
+		}
+		if (!BenchCheck(frame, RunID, SeqNo))
+			Bad++;
+		SeqNo++;
+		BenchProgress(pOnStream, &ReadPhase, Frame, &Position);
+	}
+	CancelReadAhead(pOnStream, pReadAhead);
+	BenchPhaseReport(&ReadPhase, Seconds());
+
+	printf("%u write error recoveries, %u read errors, %u frames lost, "
+	       "%u stale frames skipped, %u frames with bad data\n", 
+	       Recoveries, ReadErrors, Lost, Stale, Bad);
+	printf("%-14s %8s %10s %10s %10s %10s\n", "command", "count", "p50 ms", "p90 ms", 
+	       "p99 ms", "max ms");
+	LatencyReport(&Write);
+	LatencyReport(&Read);
+	LatencyReport(&Position);
+	LatencyReport(&Locate);
+	return signalled || Lost || Bad ? 1 : 0;
+}
+
+//***********************************************
+// DebugPrint: write a debug message. Only called through the Debug()
+// macro, once the level has been checked.
+void DebugPrint(const char *format, ...) 
+{
+	va_list args;
+
+	va_start(args, format);
+	vfprintf(fDebugFile == NULL ? stderr : fDebugFile, format, args);
+	va_end(args);
+}
+
+//***********************************************
+// TraceCommand: append one SCSI command to the binary trace (-T)
+// Inputs:  CDB, when it was issued, data bytes, pack_id, whether sg
+//          reported success, the sense data and whether it was queued
+void TraceCommand(const UINT8* pCDB, int cbCDB, const struct timeval* pStart, 
+		  unsigned int nBytes, UINT32 nPackID, bool fOK, 
+		  const UINT8* pSense, bool fQueued) 
+{
+	struct TRACE_RECORD tr;
+	struct timeval now;
+	long sec, usec;
+
+	gettimeofday(&now, NULL);
+	memset(&tr, 0, sizeof(tr));
+
+	sec  = pStart->tv_sec - TraceStart.tv_sec;
+	usec = pStart->tv_usec - TraceStart.tv_usec;
+	if (usec < 0) {
+		sec--;
+		usec += 1000000;
+	}
+	tr.StartSec  = sec;
+	tr.StartUsec = usec;
+	tr.Duration  = (now.tv_sec - pStart->tv_sec) * 1000000 + now.tv_usec - pStart->tv_usec;
+	tr.Length    = nBytes;
+	tr.PackID    = nPackID;
+	tr.CDBLength = cbCDB > 10 ? 10 : cbCDB;
+	memcpy(tr.CDB, pCDB, tr.CDBLength);
+	tr.Status    = fOK ? 0 : 1;
+	if ((pSense[0] & 0x70) == 0x70) {
+		tr.SenseKey = pSense[2] & 0x0f;
+		tr.ASC      = pSense[12];
+		tr.ASCQ     = pSense[13];
+	}
+	tr.Queued    = fQueued;
+	fwrite(&tr, sizeof(tr), 1, fTraceFile);
+}
+
+const char* OpcodeName(UINT8 opcode) 
+{
+	switch (opcode) {
+	case 0x00: return "TEST UNIT RDY";
+	case 0x01: return "REWIND";
+	case 0x03: return "REQUEST SENSE";
+	case 0x04: return "FORMAT";
+	case 0x08: return "READ";
+	case 0x0A: return "WRITE";
+	case 0x10: return "WRITE FM";
+	case 0x11: return "SPACE";
+	case 0x12: return "INQUIRY";
+	case 0x15: return "MODE SELECT";
+	case 0x19: return "ERASE";
+	case 0x1A: return "MODE SENSE";
+	case 0x1B: return "LOAD/UNLOAD";
+	case 0x1E: return "PREVENT/ALLOW";
+	case 0x2B: return "LOCATE";
+	case 0x34: return "READ POSITION";
+	case 0x55: return "MODE SELECT10";
+	case 0x5A: return "MODE SENSE10";
+	default:   return "?";
+	}
+}
+
+//***********************************************
+// DecodeTrace: print a binary trace written with -T, and a summary of
+// the time spent per command
+// Outputs: 0 if the whole file was read, -1 otherwise
+int DecodeTrace(const char* filename) 
+{
+	struct TRACE_RECORD tr;
+	char magic[sizeof(TRACE_MAGIC) - 1];
+	unsigned long count[256], total[256], longest[256];
+	unsigned long records = 0;
+	unsigned int counter;
+	FILE* fTrace;
+
+	fTrace = fopen(filename, "r");
+	if (NULL == fTrace) {
+		fprintf(stderr, "Can't open file '%s' - Error: %s (%d)\n", filename, strerror(errno), errno);
+		return -1;
+	}
+	if (fread(magic, sizeof(magic), 1, fTrace) != 1 || memcmp(magic, TRACE_MAGIC, sizeof(magic))) {
+		fprintf(stderr, "%s is not an osg trace\n", filename);
+		fclose(fTrace);
+		return -1;
+	}
+	memset(count, 0, sizeof(count));
+	memset(total, 0, sizeof(total));
+	memset(longest, 0, sizeof(longest));
+
+	printf("      time   pack_id  command        CDB                             bytes         ms  sense\n");
+	while (fread(&tr, sizeof(tr), 1, fTrace) == 1) {
+		printf("%6u.%06u %8u %c%-14s", tr.StartSec, tr.StartUsec, tr.PackID, 
+		       tr.Queued ? '*' : ' ', OpcodeName(tr.CDB[0]));
+		for (counter = 0; counter < 10; counter++) {
+			if (counter < tr.CDBLength)
+				printf(" %02x", tr.CDB[counter]);
+			else
+				printf("   ");
+		}
+		printf(" %6u %10.3f  %x/%02x/%02x%s\n", tr.Length, tr.Duration / 1000.0, 
+		       tr.SenseKey, tr.ASC, tr.ASCQ, tr.Status ? " FAILED" : "");
+
+		count[tr.CDB[0]]++;
+		total[tr.CDB[0]] += tr.Duration;
+		if (tr.Duration > longest[tr.CDB[0]])
+			longest[tr.CDB[0]] = tr.Duration;
+		records++;
+	}
+	fclose(fTrace);
+
+	printf("\n%lu commands (* = queued)\n", records);
+	printf("command          count    total ms      avg ms      max ms\n");
+	for (counter = 0; counter < 256; counter++) {
+		if (0 == count[counter])
+			continue;
+		printf("%-14s %7lu %11.3f %11.3f %11.3f\n", OpcodeName(counter), count[counter], 
+		       total[counter] / 1000.0, total[counter] / 1000.0 / count[counter], 
+		       longest[counter] / 1000.0);
+	}
+	return 0;
+}
+
+//***********************************************
+// StampStripe: mark a data frame as part of the stripe set
+void StampStripe(AUX_FRAME *pAuxFrame) 
+{
+	unsigned int u32;
+	unsigned short u16;
+
+	memcpy(pAuxFrame->DriverUnique, STRIPE_MAGIC, 4);
+	u32 = htonl(StripeSetID);
+	memcpy(&pAuxFrame->DriverUnique[4], &u32, 4);
+	u16 = htons(StripeNo);
+	memcpy(&pAuxFrame->DriverUnique[8], &u16, 2);
+	u16 = htons(nStripes);
+	memcpy(&pAuxFrame->DriverUnique[10], &u16, 2);
+}
+
+//***********************************************
+// SendStripeID: tell the process reassembling a stripe set what the
+// tape in this drive is part of, see StampStripe()
+// Outputs: false if the frame is not from a stripe set or the pipe broke
+bool SendStripeID(AUX_FRAME *pAuxFrame, FILE *fOutput) 
+{
+	STRIPE_ID Id;
+	unsigned int u32;
+	unsigned short u16;
+
+	if (memcmp(pAuxFrame->DriverUnique, STRIPE_MAGIC, 4)) {
+		Debug(0, "Stripe %u: the tape is not part of a stripe set\n", StripeNo);
+		return false;
+	}
+	memcpy(Id.Magic, STRIPE_MAGIC, 4);
+	memcpy(&u32, &pAuxFrame->DriverUnique[4], 4);
+	Id.SetID = ntohl(u32);
+	memcpy(&u16, &pAuxFrame->DriverUnique[8], 2);
+	Id.Stripe = ntohs(u16);
+	memcpy(&u16, &pAuxFrame->DriverUnique[10], 2);
+	Id.nStripes = ntohs(u16);
+	return write(fileno(fOutput), &Id, sizeof(Id)) == sizeof(Id);
+}
+
+// Pipe I/O for the stripe set, as many bytes as there are
+size_t ReadAll(int fd, unsigned char *buf, size_t count) 
+{
+	size_t done = 0;
+	ssize_t rc;
+
+	while (done < count && (rc = read(fd, buf + done, count - done)) != 0) {
+		if (rc < 0 && EINTR != errno)
+			break;
+		if (rc > 0)
+			done += rc;
+	}
+	return done;
+}
+
+bool WriteAll(int fd, unsigned char *buf, size_t count) 
+{
+	ssize_t rc;
+
+	while (count > 0) {
+		if ((rc = write(fd, buf, count)) < 0) {
+			if (EINTR == errno && !signalled)
+				continue;
+			return false;
+		}
+		buf += rc;
+		count -= rc;
+	}
+	return true;
+}
+
+// StripeName: file name for one drive of the set, name.stripe
+char* StripeName(const char *name, unsigned int stripe) 
+{
+	char *stripename;
+
+	if (NULL == name)
+		return NULL;
+	stripename = (char *) malloc(strlen(name) + 12);
+	sprintf(stripename, "%s.%u", name, stripe);
+	return stripename;
 }
 
-void Debug(const int nDebugLevel, const char *format, ...) 
+//***********************************************
+// StartStripes: stripe one stream over several drives. Frame k of the
+// stream goes to drive k % n, as its frame k / n; only the last frame
+// of the stream is short. Each drive gets its own process running the
+// normal write or read, fed through a pipe: all of the frame buffer
+// state in here is per process. Drives can run at different speeds
+// as far as the pipes (and -p) take up the difference.
+// Reading, each drive process first sends the STRIPE_ID of its tape,
+// so the tapes can be in the drives in any order.
+// Inputs:  write or read, the data file (NULL: stdin/stdout), number of
+//          drives
+// Outputs: in a drive process: its stripe number. The parent process
+//          distributes or reassembles the data and exits.
+unsigned int StartStripes(bool write, const char *filename, unsigned int nDrives) 
 {
-	char data[1024];
-	va_list args;
+	int fds[MAX_STRIPES][2], pipes[MAX_STRIPES], order[MAX_STRIPES], status, rc = 0;
+	unsigned int counter, stripe;
+	unsigned long long frame, totalBytes = 0;
+	unsigned char buf[32768];
+	STRIPE_ID Ids[MAX_STRIPES], Id;
+	pid_t pids[MAX_STRIPES];
+	FILE *fData;
+	size_t n;
+
+	nStripes = nDrives;
+	StripeSetID = (unsigned int) time(NULL) ^ ((unsigned int) getpid() << 16);
+	for (counter = 0; counter < nDrives; counter++) {
+		if (pipe(fds[counter])) {
+			Debug(0, "Can't create pipe - Error %s\n", strerror(errno));
+			exit(1);
+		}
+		fcntl(fds[counter][0], F_SETPIPE_SZ, STRIPE_PIPE);
+	}
+	for (counter = 0; counter < nDrives; counter++) {
+		if ((pids[counter] = fork()) < 0) {
+			Debug(0, "Can't fork - Error %s\n", strerror(errno));
+			exit(1);
+		}
+		if (0 == pids[counter]) {
+			/* The drive's end to stdin (write) or stdout (read) */
+			dup2(fds[counter][write ? 0 : 1], write ? 0 : 1);
+			for (stripe = 0; stripe < nDrives; stripe++) {
+				close(fds[stripe][0]);
+				close(fds[stripe][1]);
+			}
+			StripeNo = counter;
+			return counter;
+		}
+	}
+	for (counter = 0; counter < nDrives; counter++) {
+		close(fds[counter][write ? 0 : 1]);
+		pipes[counter] = fds[counter][write ? 1 : 0];
+	}
+	signal(SIGINT, signalHandler);
+	signal(SIGTERM, signalHandler);
+	signal(SIGPIPE, SIG_IGN);
 
-	va_start(args, format);
-	vsnprintf(data, 1024, format, args);
-	va_end(args);
+	if (NULL == filename)
+		fData = write ? stdin : stdout;
+	else if (NULL == (fData = fopen(filename, write ? "r" : "w"))) {
+		Debug(0, "Can't open file %s - Error %s\n", filename, strerror(errno));
+		rc = 1;
+	}
 
-	if (debug >= nDebugLevel) {
-		if (fDebugFile == NULL)
-			fprintf(stderr, data);
-		else
-			fprintf(fDebugFile, data);
+	if (0 == rc && write) {
+		for (frame = 0; !signalled; frame++) {
+			n = fread(buf, 1, 32768, fData);
+			if (n > 0 && !WriteAll(pipes[frame % nDrives], buf, n)) {
+				Debug(0, "Stripe %u: drive process gone\n", (unsigned int) (frame % nDrives));
+				rc = 1;
+				break;
+			}
+			totalBytes += n;
+			if (n < 32768)
+				break;
+		}
+	} else if (0 == rc) {
+		/* Put the pipes in stripe order */
+		memset(Ids, 0, sizeof(Ids));
+		for (counter = 0; counter < nDrives && 0 == rc; counter++) {
+			if (ReadAll(pipes[counter], (unsigned char *) &Id, sizeof(Id)) != sizeof(Id)) {
+				Debug(0, "Drive %u: no stripe found\n", counter);
+				rc = 1;
+			} else if (Id.nStripes != nDrives || Id.Stripe >= nDrives || Ids[Id.Stripe].nStripes
+				   || (counter > 0 && Id.SetID != StripeSetID)) {
+				Debug(0, "Drive %u: stripe %u of %u of set %08x does not fit\n", counter, 
+				      Id.Stripe, Id.nStripes, Id.SetID);
+				rc = 1;
+			} else {
+				StripeSetID = Id.SetID;
+				Ids[Id.Stripe] = Id;
+				order[Id.Stripe] = pipes[counter];
+			}
+		}
+		for (frame = 0; 0 == rc && !signalled; frame++) {
+			n = ReadAll(order[frame % nDrives], buf, 32768);
+			if (n > 0 && fwrite(buf, 1, n, fData) != n) {
+				Debug(0, "Write to output file failed: %s\n", strerror(errno));
+				rc = 1;
+			}
+			totalBytes += n;
+			if (n < 32768)
+				break;
+		}
+		if (fflush(fData))
+			rc = 1;
+	}
+	for (counter = 0; counter < nDrives; counter++)
+		close(pipes[counter]);
+	if (NULL != filename && NULL != fData)
+		fclose(fData);
+	for (counter = 0; counter < nDrives; counter++) {
+		if (waitpid(pids[counter], &status, 0) < 0 || !WIFEXITED(status) 
+		    || WEXITSTATUS(status)) {
+			Debug(0, "Stripe %u: drive process failed\n", counter);
+			rc = 1;
+		}
 	}
+	Debug(2, "Stripe set %08x: %Lu bytes over %u drives\n", StripeSetID, totalBytes, nDrives);
+	if (signalled)
+		rc = 1;
+	exit(rc);
 }
 
 int main(int argc, char* argv[]) 
@@ -1758,6 +5049,9 @@ int main(int argc, char* argv[])
 	unsigned long long capacity;
 	unsigned int format = 0;
 	unsigned int retry = 0;
+	UINT32 LastGood;
+	unsigned char *pending = NULL;
+	LOSTFRAMES Lost = {0, 0, false};
 	/* The ADR version: 1000*major + 2*minor */
  	unsigned int adr_version;
 	/* StartFrame and second_cfg were different in old versions */
@@ -1775,18 +5069,55 @@ int main(int argc, char* argv[])
 	FILE *fFile = stdin;
 	short SCSIDeviceNo = -1;
 	int help = 0;
-	char deviceName[32];
+	char deviceName[256];
 	int rewind = 0;
 	int retention = 0;
 	int multiple = 0;
+	unsigned int queuedepth = 1;
+	bool queued = false;
+	struct READAHEAD ReadAhead;
+	unsigned char *frame;
+	unsigned int pipeline = 0;
+	struct FRAMEQUEUE InQueue, OutQueue;
+	struct OUTPUT Output;
+	bool plainoutput = false;
+	pthread_t IOThread;
+	bool catalog = false;
+	int restorefile = -1;
+	char *indexfilename = NULL;
+	char *tracefilename = NULL;
+	char *imagefilename = NULL;
+	bool benchmark = false;
+	UINT32 BenchFirst, BenchLast;
+	struct CATALOG Catalog;
+	unsigned long StopSeqNo = 0;
+	char *checkpointname = NULL;
+	bool resume = false;
+	struct CHECKPOINT Checkpoint;
+	char *devicelist = NULL, *list, *Drives[MAX_STRIPES];
+	unsigned int nDrives = 1, stripe;
+	bool stripeid = false;
+	char *copysource = NULL;
+	struct COPYSOURCE Source;
+	struct FILEMARKS Marks;
+	unsigned char *Header = NULL;
+	struct INFLATE Inflate;
+	bool broken = false;
+	UINT32 EODFrame;
+	bool append = false;
+	struct AUX_FRAME EODAux;
 
 	opterr = 0; // Supress errors from getops
-	while ((option = getopt(argc, argv, "trwmid::f:l:s:n:")) != EOF) {
+	while ((option = getopt(argc, argv, "atrwmcRSid::b:f:k:l:s:n:q:p:x:z:C:D:E:F:T:")) != EOF) {
 		switch (option) {
 		case 'w':
 			// Write mode
 			mode = 1;
 			break;
+		case 'a':
+			append = true;
+			mode = 1;
+			break;
 		case 'm':
 			// Multiple tape mode
 			multiple = 1;
@@ -1813,6 +5144,69 @@ int main(int argc, char* argv[])
 			break;
 		case 'n':
 			SCSIDeviceNo = atoi(optarg);
+			devicelist = strdup(optarg);
+			break;
+		case 'c':
+			catalog = true;
+			break;
+		case 'x':
+			indexfilename = strdup(optarg);
+			break;
+		case 'k':
+			checkpointname = strdup(optarg);
+			break;
+		case 'R':
+			resume = true;
+			break;
+		case 'z':
+			CompressThreads = atoi(optarg);
+			if (CompressThreads < 1 || CompressThreads > MAX_COMPRESS_THREADS) {
+				help = 1;
+			}
+#ifndef HAVE_ZLIB
+			Debug(0, "osg was built without zlib, no compression\n");
+			help = 1;
+#endif
+			break;
+		case 'C':
+			copysource = strdup(optarg);
+			mode = 1;
+			break;
+		case 'T':
+			tracefilename = strdup(optarg);
+			break;
+		case 'E':
+			imagefilename = strdup(optarg);
+			break;
+		case 'S':
+			plainoutput = true;
+			break;
+		case 'b':
+			benchmark = true;
+			if (sscanf(optarg, "%lu:%lu", &BenchFirst, &BenchLast) != 2 
+			    || BenchFirst < 10 || BenchLast < BenchFirst) {
+				help = 1;
+			}
+			break;
+		case 'D':
+			exit(DecodeTrace(optarg));
+		case 'F':
+			restorefile = atoi(optarg);
+			if (restorefile < 0) {
+				help = 1;
+			}
+			break;
+		case 'p':
+			pipeline = atoi(optarg);
+			if (pipeline < 2) {
+				help = 1;
+			}
+			break;
+		case 'q':
+			queuedepth = atoi(optarg);
+			if (queuedepth < 1 || queuedepth > MAX_QUEUE_DEPTH) {
+				help = 1;
+			}
 			break;
 		case 's':
 			StartFrameSet = true;
@@ -1824,19 +5218,67 @@ int main(int argc, char* argv[])
 		}
 	}
 
-	if (help || SCSIDeviceNo == -1) {
+	if (restorefile >= 0 && NULL == indexfilename) {
+		help = 1;
+	}
+	if ((resume && (NULL == checkpointname || mode != 1)) || (NULL != checkpointname && multiple)) {
+		help = 1;
+	}
+	/* A list of drives makes a stripe set */
+	list = NULL != imagefilename ? imagefilename : devicelist;
+	if (NULL != list && NULL != strchr(list, ',')) {
+		for (nDrives = 0, list = strtok(list, ","); NULL != list && nDrives < MAX_STRIPES; 
+		     list = strtok(NULL, ","))
+			Drives[nDrives++] = list;
+		if (nDrives < 2 || NULL != list || catalog || restorefile >= 0 || benchmark || multiple) {
+			help = 1;
+		}
+	}
+	if (NULL != copysource && (resume || multiple || nDrives > 1 || NULL != filename)) {
+		help = 1;
+	}
+	if (CompressThreads && (NULL != copysource || resume)) {
+		help = 1;
+	}
+	/* Checkpoints and stripes go from the start of the tape */
+	if (append && (NULL != copysource || resume || multiple || nDrives > 1 || NULL != checkpointname)) {
+		help = 1;
+	}
+
+	if (help || (SCSIDeviceNo == -1 && NULL == imagefilename)) {
 		fprintf(stderr, "%s: SCSI Generic OnStream Tape interface. Written by Terry Hardie.\nVersion %s\n", argv[0], VERSION);
 		fprintf(stderr, "usage: %s -n device no [-d [level]] [-o filename] [-s block] [-w]\n", argv[0]);
 		fprintf(stderr, "       -n device No SCSI device number of OnStream drive **\n");
-		fprintf(stderr, "       -d [level]   set debug mode to level\n");
+		fprintf(stderr, "                    a list (0,1,...) stripes over up to %d drives\n", MAX_STRIPES);
+		fprintf(stderr, "       -a           append to the tape at its EOD, as a new file (implies -w)\n");
+		fprintf(stderr, "       -b first:last benchmark: write and read back frames first to last\n");
+		fprintf(stderr, "                    (overwrites them!) and report speed and latencies\n");
+		fprintf(stderr, "       -c           catalog the tape into the index file (-x) and exit\n");
+		fprintf(stderr, "       -C device    copy the tape in this drive (SCSI device number or tape\n");
+		fprintf(stderr, "                    image) to the one of -n/-E, overwriting it\n");
+		fprintf(stderr, "       -d [level]   set debug mode to level (max %d in this build)\n", OSG_MAX_DEBUG);
+		fprintf(stderr, "       -D filename  print a command trace written with -T and exit\n");
+		fprintf(stderr, "       -E filename  use a tape image file as an emulated drive instead of -n\n");
+		fprintf(stderr, "                    (a list: a stripe set, as with -n)\n");
+		fprintf(stderr, "                    or an os_dump -c image, read only\n");
+		fprintf(stderr, "       -F file      restore only this file (0, 1, ...) using the index (-x)\n");
 		fprintf(stderr, "       -i           initialize, if tape is in an unknown format\n");
+		fprintf(stderr, "       -k filename  keep a checkpoint of the write progress in named file\n");
 		fprintf(stderr, "       -l filename  write debugging output to named file\n");
 		fprintf(stderr, "       -m           Multiple tape mode ***\n");
 		fprintf(stderr, "       -f filename  Use named file for data source/deposit\n");
+		fprintf(stderr, "       -p frames    do file I/O in a separate thread, buffering frames\n");
+		fprintf(stderr, "       -q depth     keep up to depth (max %d) frame commands queued\n", MAX_QUEUE_DEPTH);
 		fprintf(stderr, "       -r           Rewind tape when operation completes successfully\n");
+		fprintf(stderr, "       -R           resume the write from the checkpoint (-k), with the\n");
+		fprintf(stderr, "                    same input from its start\n");
 		fprintf(stderr, "       -s block     start reading from this block, instead of start of tape\n");
+		fprintf(stderr, "       -S           restore through stdio, without vmsplice or direct I/O\n");
 		fprintf(stderr, "       -t           ReTension the tape before doing any read/write\n");
+		fprintf(stderr, "       -T filename  write a binary trace of all SCSI commands to file\n");
 		fprintf(stderr, "       -w           write mode\n");
+		fprintf(stderr, "       -x filename  index file for -c and -F (-c default: stdout)\n");
+		fprintf(stderr, "       -z threads   compress what is written, using that many threads (max %d)\n", MAX_COMPRESS_THREADS);
 		fprintf(stderr, "\n");
 		fprintf(stderr, "** This is not the SCSI ID number, but rather which numbered device in\n");
 		fprintf(stderr, "   the bus this device is. For Eaxmple, if you have a hard drive at ID 2,\n");
@@ -1849,6 +5291,18 @@ int main(int argc, char* argv[])
 		exit(-1);
 	}
 
+	if (nDrives > 1) {
+		/* From here on we are one drive of the set */
+		stripe = StartStripes(mode == 1, filename, nDrives);
+		if (NULL != imagefilename)
+			imagefilename = Drives[stripe];
+		else
+			SCSIDeviceNo = atoi(Drives[stripe]);
+		filename = NULL;
+		checkpointname = StripeName(checkpointname, stripe);
+		tracefilename = StripeName(tracefilename, stripe);
+	}
+
 	if (NULL != logfilename) {
 		fDebugFile = fopen(logfilename, "a+");
 		if (NULL == fDebugFile) {
@@ -1859,7 +5313,20 @@ int main(int argc, char* argv[])
 		fDebugFile = NULL;
 	}
 
-	sprintf(deviceName, "/dev/sg%d", SCSIDeviceNo);
+	if (NULL != tracefilename) {
+		fTraceFile = fopen(tracefilename, "w");
+		if (NULL == fTraceFile) {
+			fprintf(stderr, "Can't open file '%s' - Error: %s (%d)\n", tracefilename, strerror(errno), errno);
+			exit(-1);
+		}
+		fwrite(TRACE_MAGIC, sizeof(TRACE_MAGIC) - 1, 1, fTraceFile);
+		gettimeofday(&TraceStart, NULL);
+	}
+
+	if (NULL != imagefilename)
+		snprintf(deviceName, sizeof(deviceName), "%s", imagefilename);
+	else
+		sprintf(deviceName, "/dev/sg%d", SCSIDeviceNo);
 
 	signal(SIGHUP, signalHandler);
 	signal(SIGINT, signalHandler);
@@ -1871,13 +5338,28 @@ int main(int argc, char* argv[])
 	signal(SIGUSR1, signalHandler);
 	signal(SIGUSR2, signalHandler);
 
-	pOnStream = new OnStream(deviceName);
+	/* Make sure there is something to copy before the target is touched */
+	if (NULL != copysource && !OpenCopySource(copysource, queuedepth, &Source)) {
+		delete Source.pOnStream;
+		return 1;
+	}
+
+	pOnStream = new OnStream(deviceName, NULL != imagefilename);
 
 	if (!pOnStream->IsOnstream()) {
 		delete pOnStream;
 		return 1;
 	}
 
+	if (queuedepth > 1) {
+		if (pOnStream->SetQueueDepth(queuedepth) < queuedepth)
+			Debug(0, "Command queuing not available, queue depth is %d\n", pOnStream->QueueDepth());
+		queued = pOnStream->QueueDepth() > 1;
+	}
+	ReadAhead.Frames = queued ? (unsigned char *) malloc(pOnStream->QueueDepth() * 33280) : NULL;
+	ReadAhead.nNext = 0;
+	memset(&Catalog, 0, sizeof(Catalog));
+
 	do {
 		Debug(2, "Initializing.\n");
 
@@ -1930,6 +5412,17 @@ int main(int argc, char* argv[])
 		pOnStream->BufferStatus(&MaxBuffer, &CurrentBuffer);
 		CurrentTapeBuffer = CurrentBuffer;
 
+		if (benchmark) {
+			if (BenchLast >= TotalFrames) {
+				Debug(0, "Benchmark range ends past the last frame (%lu)\n", TotalFrames - 1);
+				delete pOnStream;
+				return 1;
+			}
+			rc = Benchmark(pOnStream, BenchFirst, BenchLast, &CurrentTapeBuffer, &ReadAhead);
+			delete pOnStream;
+			return rc;
+		}
+
 
 		Debug(2, "Locating Config.\n");
 		if (false == pOnStream->Locate(5)) {
@@ -1990,10 +5483,32 @@ int main(int argc, char* argv[])
 			}
 		}
 
-		if (mode == 1) {
+		/* The header frames get EOD and filemarks when we are done */
+		if (mode == 1 && NULL == Header)
+			Header = (unsigned char *) malloc(33280);
+		memset(&Marks, 0, sizeof(Marks));
+
+		if (mode == 1 && resume) {
+			if (!FormatUnderstood) {
+				Debug(0, "Can't resume on a tape in an unknown format\n");
+				return 1;
+			}
+			if (!LoadCheckpoint(checkpointname, &Checkpoint))
+				return 1;
+			memcpy(Header, buf, 33280);
+			Debug(2, "Resuming write pass %d from %s\n", WritePass, checkpointname);
+		} else if (mode == 1 && append) {
+			if (!FormatUnderstood) {
+				Debug(0, "Can't append to a tape in an unknown format\n");
+				return 1;
+			}
+			memcpy(Header, buf, 33280);
+			if (!FindAppendPoint(pOnStream, Header, WritePass, StartFrame, &Marks, 
+					     &CurrentFrame, &EODAux))
+				return 1;
+		} else if (mode == 1) {
 			// write
 			// Check if the tape has valid config...
-
 			if (FormatUnderstood) {
 				// The tape is configured correctly. Increment the write pass counter
 				Debug(2, "Tape is formatted already.\n");
@@ -2002,6 +5517,9 @@ int main(int argc, char* argv[])
 				cpAndSwap(&buf[22], &WritePass, 2);
 				AuxFrame.UpdateFrameCounter++;
 				memcpy(&AuxFrame.ApplicationSig, VENDORID, 4);
+				/* EOD and filemarks of the last pass are gone */
+				memset(&buf[32], 0, 4);
+				memset(&buf[17736], 0, 16 + 4 * FM_TAB_MAX);
 			} else {
 				// First, we need to write config frames. Setup their stucture:
 				Debug(0, "Tape format is not recognised. Reformatting.\n");
@@ -2030,52 +5548,16 @@ int main(int argc, char* argv[])
 
 			Debug(2, "Writing Config frames (0x05 - 0x09)...");
 
-			CurrentFrame = 5;
-			if (false == pOnStream->Locate(5)) {
-				Debug(0, "main: Locate failed: '%s'\n", szOnStreamErrors[pOnStream->GetLastError()]);
+			if (!WriteConfigFrames(pOnStream, buf, 5, false, &LastTapeBuffer, &CurrentTapeBuffer)) {
 				delete pOnStream;
 				return 1;
 			}
-			WaitForReady(pOnStream);
-
-			while (CurrentFrame < 0x0A) {
-				if (false == pOnStream->Write(buf, 33280)) {
-					Debug(0, "main: write failed: '%s'\n", szOnStreamErrors[pOnStream->GetLastError()]);
-					delete pOnStream;
-					return 1;
-				}
-				AddFrameToBuffer(&LastTapeBuffer, buf);
-				CheckWrittenFrames(pOnStream, &TapeBuffer, 1, &CurrentTapeBuffer);
-				CurrentFrame++;
-			}
-			pOnStream->Flush();
-			WaitForReady(pOnStream);
-			if (OS_NEED_POLL(pOnStream->FWRev()))
-			    pOnStream->WaitPosition(CurrentFrame, 100, 1);
-			
 			Debug(2, "(0x%03x - 0x%03x)...", second_cfg, second_cfg+4);
-			CurrentFrame = second_cfg;
-			if (false == pOnStream->Locate(CurrentFrame, true)) {
-				Debug(0, "main: Locate failed: '%s'\n", szOnStreamErrors[pOnStream->GetLastError()]);
+			if (!WriteConfigFrames(pOnStream, buf, second_cfg, true, &LastTapeBuffer, &CurrentTapeBuffer)) {
 				delete pOnStream;
 				return 1;
 			}
-			WaitForReady(pOnStream);
-			
-			while (CurrentFrame < second_cfg + 5) {
-				if (false == pOnStream->Write(buf, 33280)) {
-					Debug(0, "main: write failed: '%s'\n", szOnStreamErrors[pOnStream->GetLastError()]);
-					delete pOnStream;
-					return 1;
-				}
-				AddFrameToBuffer(&LastTapeBuffer, buf);
-				CheckWrittenFrames(pOnStream, &TapeBuffer, 1, &CurrentTapeBuffer);
-				CurrentFrame++;
-			}
-			pOnStream->Flush();
-			WaitForReady(pOnStream);
-			if (OS_NEED_POLL(pOnStream->FWRev()))
-			    pOnStream->WaitPosition (CurrentFrame, 100, 1);
+			memcpy(Header, buf, 33280);
 			Debug(2, "Done.\nRewinding to start of user data (Frame = %d)\n", StartFrame);
 
 			if (false == pOnStream->Locate(StartFrame, true)) {
@@ -2088,7 +5570,11 @@ int main(int argc, char* argv[])
 			CurrentFrame = StartFrame;
 			//if (OS_NEED_POLL(pOnStream->FWRev()))
 			    // pOnStream->WaitPosition (CurrentFrame, 50);
+			memset(&Checkpoint, 0, sizeof(Checkpoint));
+			Checkpoint.WritePass = WritePass;
+		}
 
+		if (mode == 1) {
 			// Setup AuxFrame for user data
 			memset(&AuxFrame, 0, sizeof(AuxFrame));
 			memcpy(&AuxFrame.ApplicationSig, VENDORID, 4);
@@ -2102,6 +5588,8 @@ int main(int argc, char* argv[])
 			AuxFrame.FrameSequenceNumber = 0;
 			AuxFrame.LogicalBlockAddress = 0;
 			AuxFrame.LastMarkFrameAddress = 0xFFFFFFFF;
+			if (nStripes > 1)
+				StampStripe(&AuxFrame);
 
 			if (NULL != filename) {
 				if (NULL == (fFile = fopen(filename, "r"))) {
@@ -2110,38 +5598,158 @@ int main(int argc, char* argv[])
 				}
 				Debug(4, "Opened file %s for reading\n", filename);
 			}
+			/* The input threads read with ReadInput(), past stdio */
+			if (pipeline || CompressThreads)
+				setvbuf(fFile, NULL, _IONBF, 0);
+
+			if (resume) {
+				unsigned long SeqNo;
+
+				if (!ResumeWrite(pOnStream, &ReadAhead, &Checkpoint, WritePass, StartFrame, 
+						 second_cfg, &CurrentFrame, &SeqNo))
+					return 1;
+				if (false == pOnStream->Locate(CurrentFrame, true)) {
+					Debug(0, "main: Locate failed: '%s'\n", szOnStreamErrors[pOnStream->GetLastError()]);
+					delete pOnStream;
+					return 1;
+				}
+				WaitForReady(pOnStream);
+				AuxFrame.FrameSequenceNumber = SeqNo;
+				AuxFrame.LogicalBlockAddress = SeqNo;
+				/* The checkpoint may be a bit ahead of the frame we go on after */
+				Checkpoint.nFrames = SeqNo;
+				if (!SkipInput(fFile, (unsigned long long) SeqNo * 32768)) {
+					Debug(0, "Can't skip %Lu bytes of input - error %s\n", 
+					      (unsigned long long) SeqNo * 32768, strerror(errno));
+					return 1;
+				}
+				Debug(0, "Resuming at frame %lu, input offset %Lu\n", CurrentFrame, 
+				      (unsigned long long) SeqNo * 32768);
+			}
+
+			if (append) {
+				if (false == pOnStream->Locate(CurrentFrame, true)) {
+					Debug(0, "main: Locate failed: '%s'\n", szOnStreamErrors[pOnStream->GetLastError()]);
+					delete pOnStream;
+					return 1;
+				}
+				WaitForReady(pOnStream);
+				AuxFrame.FrameSequenceNumber = EODAux.FrameSequenceNumber;
+				AuxFrame.LogicalBlockAddress = EODAux.LogicalBlockAddress;
+				AuxFrame.FilemarkCount = EODAux.FilemarkCount;
+				AuxFrame.LastMarkFrameAddress = Marks.nMarks ? Marks.Frames[Marks.nMarks - 1] : 0xFFFFFFFF;
+			}
+			if (append && CurrentFrame > StartFrame) {
+				/* A filemark over the old EOD ends the file before ours */
+				AuxFrame.FrameType = 0x0200;
+				memset(buf, 0, 33280);
+				FormatAuxFrame(AuxFrame, &buf[32768]);
+				Debug(2, "Writing filemark frame at %lu.\n", CurrentFrame);
+				if (false == pOnStream->Write(buf, 33280)) {
+					Debug(0, "main: write failed: '%s'\n", szOnStreamErrors[pOnStream->GetLastError()]);
+					delete pOnStream;
+					return 1;
+				}
+				AddFrameToBuffer(&LastTapeBuffer, buf);
+				CheckWrittenFrames(pOnStream, &TapeBuffer, 1, &CurrentTapeBuffer);
+				if (CheckSense(pOnStream)) {
+					return -1;
+				}
+				if (Marks.nMarks < FM_TAB_MAX)
+					Marks.Frames[Marks.nMarks] = CurrentFrame;
+				Marks.nMarks++;
+				AuxFrame.LastMarkFrameAddress = CurrentFrame;
+				AuxFrame.FilemarkCount++;
+				AuxFrame.FrameSequenceNumber++;
+				AuxFrame.LogicalBlockAddress++;
+				AuxFrame.FrameType = 0x8000;
+				if (++CurrentFrame == second_cfg) {
+					CurrentFrame = 0xBB8;
+					if (false == pOnStream->Locate(0xBB8, true)) {
+						Debug(0, "main: Locate failed: '%s'\n", szOnStreamErrors[pOnStream->GetLastError()]);
+						delete pOnStream;
+						return 1;
+					}
+					WaitForReady(pOnStream);
+				}
+			}
 
 			Debug(3, "main: starting write\n");
 			startTime = time(NULL);
 			unsigned char * readbuf = (unsigned char *) malloc (131072);
 			char endpad = 0;
-			while ((feof(fFile) == 0 || endpad) && !signalled) {
-				if (!retry) {
+			unsigned char *wbuf = buf;
+			bool lastframe = false;
+			/* Input is read 4 frames at a time from here (an append may
+			 * not start at a multiple of 4) */
+			unsigned long FirstSeqNo = AuxFrame.FrameSequenceNumber;
+			/* The source drive fills a frame ring in its own thread */
+			if (NULL != copysource && 0 == pipeline)
+				pipeline = COPY_RING;
+#ifdef HAVE_ZLIB
+			if (CompressThreads && 0 == pipeline)
+				pipeline = COPY_RING;
+#endif
+			if (pipeline && !StartFrameQueue(&InQueue, pipeline, fFile, 
+#ifdef HAVE_ZLIB
+							 CompressThreads ? CompressThread : 
+#endif
+							 NULL != copysource ? CopyThread : InputThread, &IOThread, 
+							 NULL, NULL != copysource ? &Source : NULL)) {
+				Debug(0, "Can't start input thread\n");
+				return 1;
+			}
+			while ((pipeline ? !(lastframe && !retry) : (feof(fFile) == 0 || endpad)) && !signalled) {
+				if (!retry && pipeline) {
+					unsigned int size, sync;
+					/* The frame written last is with the drive now */
+					if (wbuf != buf)
+						FrameQueueRelease(&InQueue);
+					if (NULL == (wbuf = FrameQueuePeek(&InQueue, &size, &sync)))
+						break;
+					totalBytes += size;
+					if (NULL != copysource) {
+						/* Short frames can come anywhere, the ring ends it */
+						RestampFrame(&AuxFrame, wbuf, CurrentFrame, &Marks);
+					} else {
+						lastframe = size < 32768;
+						AuxFrame.DataAccessTable.DataAccessTableEntry[0].size = size;
+						AuxFrame.DataAccessTable.DataAccessTableEntry[0].LogicalElements = 1;
+						AuxFrame.DataAccessTable.DataAccessTableEntry[0].flags = 
+							CompressThreads ? 0xC | DAT_COMPRESSED : 0xC;
+						if (CompressThreads) {
+							memcpy(&AuxFrame.DriverUnique[16], COMPRESS_MAGIC, 4);
+							PutBE32(&AuxFrame.DriverUnique[20], sync);
+						}
+
+						FormatAuxFrame(AuxFrame, &wbuf[32768]);
+					}
+				} else if (!retry) {
 					//memset(buf, 0, 33280);
-					if (!(AuxFrame.FrameSequenceNumber % 4))
+					if (!((AuxFrame.FrameSequenceNumber - FirstSeqNo) % 4))
 					{
 						rc = fread(readbuf, 1, 131072, fFile);
 						totalBytes += rc;
 						if (rc < 131072)
 						{
-							memset(readbuf, 0, 131072-rc);
+							memset(readbuf + rc, 0, 131072-rc);
 							endpad = rc / 32768;
 						}
 					}
 					else
 						if (endpad) endpad--;
-					memcpy(buf, readbuf+32768*(AuxFrame.FrameSequenceNumber % 4), 32768);
+					memcpy(wbuf, readbuf+32768*((AuxFrame.FrameSequenceNumber - FirstSeqNo) % 4), 32768);
 					if (feof(fFile) && !endpad) AuxFrame.DataAccessTable.DataAccessTableEntry[0].size = rc % 32768;
 					else AuxFrame.DataAccessTable.DataAccessTableEntry[0].size = 32768;
 					AuxFrame.DataAccessTable.DataAccessTableEntry[0].LogicalElements = 1;
 					AuxFrame.DataAccessTable.DataAccessTableEntry[0].flags = 0xC;
 
-					FormatAuxFrame(AuxFrame, &buf[32768]);
+					FormatAuxFrame(AuxFrame, &wbuf[32768]);
 				}
 				if (debug > 9) {
 					int counter;
 					for (counter = 32768; counter <= 33280; counter++) {
-						Debug(10, "%02x ", (unsigned char) buf[counter]);
+						Debug(10, "%02x ", (unsigned char) wbuf[counter]);
 						if (counter / 16.0 == counter / 16) {
 							Debug(10, "\n");
 						}
@@ -2151,12 +5759,29 @@ int main(int argc, char* argv[])
 					Debug(10, "Writing block %ld\n", CurrentFrame);
 				}
 							    
-				if (OS_NEED_POLL(pOnStream->FWRev()))
+				if (queued) {
+					/* The shadow copy stays until the drive has the frame on
+					 * tape, so it is the buffer we queue */
+					AddFrameToBuffer(&LastTapeBuffer, wbuf);
+					if (false == pOnStream->QueueWrite(LastTapeBuffer->Frame, 33280, AuxFrame.FrameSequenceNumber)) {
+						Debug(0, "main: write failed: '%s'\n", szOnStreamErrors[pOnStream->GetLastError()]);
+						delete pOnStream;
+						return 1;
+					}
+					UncheckedFrames++;
+					AuxFrame.FrameSequenceNumber++;
+					AuxFrame.LogicalBlockAddress++;
+					CurrentFrame++;
+					/* Drain the queue before locating past the second config area */
+					CurrentSense = SyncQueuedWrites(pOnStream, 
+						CurrentFrame == second_cfg ? 0 : pOnStream->QueueDepth() - 1, 
+						&CurrentTapeBuffer);
+				} else if (OS_NEED_POLL(pOnStream->FWRev()))
 					CurrentSense = pOnStream->WaitPosition (CurrentFrame, 30, MAX_FILL_BUFF);
 				else
 					CurrentSense = SNoSense;
-				if (CurrentSense == SNoSense) {
-					if (false == pOnStream->Write(buf, 33280)) {
+				if (CurrentSense == SNoSense && !queued) {
+					if (false == pOnStream->Write(wbuf, 33280)) {
 						Debug(0, "main: write failed: '%s'\n", szOnStreamErrors[pOnStream->GetLastError()]);
 						CheckSense(pOnStream);
 						delete pOnStream;
@@ -2171,13 +5796,21 @@ int main(int argc, char* argv[])
 				switch (CurrentSense) {
 				case SNoSense:
 					retry = 0;
-					AddFrameToBuffer(&LastTapeBuffer, buf);
+					if (queued)
+						break;
+					AddFrameToBuffer(&LastTapeBuffer, wbuf);
 					AuxFrame.FrameSequenceNumber++;
 					AuxFrame.LogicalBlockAddress++;
 					CurrentFrame++;
-					CheckWrittenFrames(pOnStream, &TapeBuffer, 1, &CurrentTapeBuffer);
+					NoteWrittenFrames(pOnStream, &TapeBuffer, 1, &CurrentTapeBuffer);
 					break;
 				case SMediumWriteError:
+					if (queued) {
+						/* Frames queued behind the bad one may have been taken
+						 * or refused: rewrite all we still hold */
+						CurrentFrame += RequeueData(pOnStream, &TapeBuffer, 0, &CurrentTapeBuffer, 80);
+						break;
+					}
 					pOnStream->GetLastSense(sense);
 					skip = (unsigned int) (unsigned char) sense[9];
 					Debug (2, "WriteError: Device advised to skip %i\n", skip);
@@ -2216,7 +5849,7 @@ int main(int argc, char* argv[])
 					Debug(2, "Done.\n");
 
 					RequeueData(pOnStream, &TapeBuffer, 0, &CurrentTapeBuffer, 0, true);
-					retry = 1;
+					retry = !queued;
 					break;
 				default:
 					Debug(0, "Unhandled sense %d\n", CurrentSense);
@@ -2224,9 +5857,10 @@ int main(int argc, char* argv[])
 				}
 				
 
-				pOnStream->BufferStatus(&MaxBuffer, &CurrentBuffer);
-
-				Debug(6, "Max buffer = %d Current = %d\n", MaxBuffer, CurrentBuffer);
+				if (!queued && debug > 5) {
+					pOnStream->BufferStatus(&MaxBuffer, &CurrentBuffer);
+					Debug(6, "Max buffer = %d Current = %d\n", MaxBuffer, CurrentBuffer);
+				}
 
 				if (CurrentFrame == second_cfg) {
 					Debug(2, "Skipping over secondary config area.\n");
@@ -2238,14 +5872,29 @@ int main(int argc, char* argv[])
 					}
 					WaitForReady(pOnStream);
 				}
+				if (NULL != checkpointname)
+					UpdateCheckpoint(checkpointname, &Checkpoint, CurrentFrame, 
+							 AuxFrame.FrameSequenceNumber, AuxFrame.LogicalBlockAddress, 
+							 second_cfg, false);
 			}
 
+			if (pipeline) {
+				StopFrameQueue(&InQueue, IOThread);
+				wbuf = buf;
+				if (CompressThreads && totalBytes)
+					Debug(1, "Compressed %Lu bytes to %Lu (%.2f:1)\n", InQueue.nBytes, totalBytes, 
+					      InQueue.nBytes / (double) totalBytes);
+			}
 			if (multiple == 0) {
 				fclose(fFile);
 			}
 			free (readbuf);
 
+			if (queued && SNoSense != SyncQueuedWrites(pOnStream, 0, &CurrentTapeBuffer)) 
+				CurrentFrame += RequeueData(pOnStream, &TapeBuffer, 0, &CurrentTapeBuffer, 80);
+
 			// Write EOD frame
+			EODFrame = CurrentFrame;
 			AuxFrame.FrameType = 0x0100;
 			// TODO: Write completely valid EOD
 			memset(buf, 0, 33280);
@@ -2262,7 +5911,31 @@ int main(int argc, char* argv[])
 				return -1;
 			}
 
-			WaitForWrite(pOnStream, &TapeBuffer, &CurrentTapeBuffer);
+			WaitForWrite(pOnStream, &TapeBuffer, &CurrentTapeBuffer, 0);
+
+			/* Interrupted: all up to the EOD frame is on tape, go on from
+			 * there with -R. Done: nothing to go on from. */
+			if (NULL != checkpointname && signalled)
+				UpdateCheckpoint(checkpointname, &Checkpoint, CurrentFrame, 
+						 AuxFrame.FrameSequenceNumber, AuxFrame.LogicalBlockAddress, 
+						 second_cfg, true);
+			else if (NULL != checkpointname)
+				unlink(checkpointname);
+
+			if (!UpdateHeader(pOnStream, Header, EODFrame, &Marks, second_cfg, 
+					  &LastTapeBuffer, &CurrentTapeBuffer)) {
+				delete pOnStream;
+				return 1;
+			}
+			if (NULL != copysource) {
+				Debug(1, "Copied %lu frames, %u filemarks\n", Source.nFrames, Marks.nMarks);
+				if (Source.Lost.nFrames)
+					Debug(0, "%lu logical frames lost in %u stretches on the source\n", 
+					      Source.Lost.nFrames, Source.Lost.nRanges);
+				if (Source.Lost.fGaveUp)
+					Debug(0, "No EOD found on the source, the copy may be incomplete\n");
+				delete Source.pOnStream;
+			}
 
 			pOnStream->ShowPosition(NULL, NULL);
 			WaitForReady(pOnStream);
@@ -2288,8 +5961,12 @@ int main(int argc, char* argv[])
 				WaitForReady(pOnStream);
 				Debug(2, "Done.\n");
 			}
-			Debug(2, "%Ld bytes in %ld seconds (%Ld bytes/sec %0.3f kbytes/sec %0.3f Mbytes/sec)\n", totalBytes, time(NULL) - startTime, totalBytes / (int) (time(NULL) - startTime), totalBytes / (float) (time(NULL) - startTime) / 1024.0, totalBytes / (float) (time(NULL) - startTime) / 1048576.0);
+			Debug(2, "%Ld bytes in %ld seconds (%Ld bytes/sec %0.3f kbytes/sec %0.3f Mbytes/sec)\n", totalBytes, time(NULL) - startTime, totalBytes / (time(NULL) > startTime ? (int) (time(NULL) - startTime) : 1), totalBytes / (float) (time(NULL) - startTime) / 1024.0, totalBytes / (float) (time(NULL) - startTime) / 1048576.0);
 			if (signalled) raise (signalled);
+			if (NULL != copysource && (Source.Lost.nFrames || Source.Lost.fGaveUp)) {
+				delete pOnStream;
+				return 1;
+			}
 #if 0
 			Debug(2, "Waiting for more data...\n");
 			
@@ -2311,6 +5988,41 @@ int main(int argc, char* argv[])
 #endif
 
 		} else { /* read mode */
+			if (catalog) {
+				/* FormatUnderstood, so buf still holds the header frame */
+				Catalog.WritePass = WritePass;
+				if (!CatalogFromHeader(pOnStream, buf, StartFrame, &Catalog)) {
+					Catalog.nEntries = 0;
+					if (!CatalogScan(pOnStream, &ReadAhead, buf, StartFrame, &Catalog)) {
+						Debug(0, "main: Catalog scan failed: '%s'\n", szOnStreamErrors[pOnStream->GetLastError()]);
+						delete pOnStream;
+						return 1;
+					}
+				}
+				Debug(1, "%d files on tape\n", Catalog.nEntries);
+				if (!SaveCatalog(indexfilename, &Catalog))
+					return 1;
+				delete pOnStream;
+				return 0;
+			}
+			if (restorefile >= 0) {
+				if (!LoadCatalog(indexfilename, &Catalog))
+					return 1;
+				if (Catalog.WritePass != WritePass) {
+					Debug(0, "Index %s is for write pass %d, tape has %d\n", 
+					      indexfilename, Catalog.WritePass, WritePass);
+					return 1;
+				}
+				if ((unsigned int) restorefile >= Catalog.nEntries) {
+					Debug(0, "No file %d on tape, index has %d files\n", restorefile, Catalog.nEntries);
+					return 1;
+				}
+				StartFrame = Catalog.Entries[restorefile].FirstFrame;
+				StartFrameSet = true;
+				StopSeqNo = Catalog.Entries[restorefile].EndSeq;
+				Debug(2, "File %d: frames %d-%d\n", restorefile, StartFrame, 
+				      Catalog.Entries[restorefile].LastFrame);
+			}
 			Debug(2, "Moving to start of user data. Frame = %d\n", StartFrame);
 			if (false == pOnStream->Locate(StartFrame)) {
 				Debug(0, "main: Locate failed: '%s'\n", szOnStreamErrors[pOnStream->GetLastError()]);
@@ -2342,66 +6054,67 @@ int main(int argc, char* argv[])
 			
 			startTime = time(NULL);
 			CurrentSeqNo = 0;
+			if (restorefile >= 0)
+				CurrentSeqNo = Catalog.Entries[restorefile].FirstSeq;
+			if (!OutputOpen(&Output, fil, plainoutput, restorefile < 0 ? 0 : 
+					(unsigned long long) (Catalog.Entries[restorefile].EndSeq 
+					- Catalog.Entries[restorefile].FirstSeq) * 32768))
+				return 1;
+			if (pipeline && !StartFrameQueue(&OutQueue, pipeline, fil, OutputThread, &IOThread, &Output)) {
+				Debug(0, "Can't start output thread\n");
+				return 1;
+			}
+			LastGood = StartFrame;
+			memset(&Inflate, 0, sizeof(Inflate));
+			Inflate.Output = &Output;
+			Inflate.Queue = pipeline ? &OutQueue : NULL;
 
 			while (!eof && !signalled) {
-				if (OS_NEED_POLL(pOnStream->FWRev()))
-					CurrentSense = pOnStream->WaitPosition (CurrentFrame);
-				else
+				unsigned char *rbuf = pipeline ? buf : OutputReserve(&Output, buf);
+				/* Read straight into the next output slot if we can */
+				if (pipeline && NULL == (rbuf = FrameQueueReserve(&OutQueue)))
+					break;
+				if (NULL != pending) {
+					/* Found by RecoverRead(), already read */
+					frame = pending;
+					pending = NULL;
 					CurrentSense = SNoSense;
-				if (CurrentSense == SNoSense) {
-					if (false == pOnStream->Read(buf)) {
-						Debug(0, "main: Read 0 failed: '%s'\n", szOnStreamErrors[pOnStream->GetLastError()]);
-						delete pOnStream;
-						return 1;
+				} else {
+					if (OS_NEED_POLL(pOnStream->FWRev()))
+						CurrentSense = pOnStream->WaitPosition (CurrentFrame);
+					else
+						CurrentSense = SNoSense;
+					if (CurrentSense == SNoSense) {
+						if (NULL == (frame = ReadFrame(pOnStream, &ReadAhead, rbuf))) {
+							Debug(0, "main: Read 0 failed: '%s'\n", szOnStreamErrors[pOnStream->GetLastError()]);
+							delete pOnStream;
+							return 1;
+						}
+						CurrentSense = CheckSense(pOnStream);
 					}
-					CurrentSense = CheckSense(pOnStream);
 				}
 				switch (CurrentSense) {
 				case SNoSense:
 					break;
 				case SUnrecoveredReadError:
 				case STimeoutWaitPos:
-					// See if the next readable frame has our data in it.
-					Debug(2, "Unrecoverable read error at frame %ld. Checking next block...\n", CurrentFrame);
-					if (retry++ > 5) {
-						eof = 1;
-						continue;
-					}
-					if (CurrentSense == SUnrecoveredReadError) CurrentFrame++;
-					else CurrentFrame += 40;
-					if (false == pOnStream->Locate(CurrentFrame)) {
-						Debug(0, "main: Locate failed: '%s'\n", szOnStreamErrors[pOnStream->GetLastError()]);
-						delete pOnStream;
-						return 1;
-					}
-					if (false == pOnStream->StartRead()) {
-						Debug(0, "main: Read failed: '%s'\n", szOnStreamErrors[pOnStream->GetLastError()]);
-						delete pOnStream;
-						return 1;
-					}
-					WaitForReady(pOnStream);
-					continue;
 				case SEOD:
-					Debug(2, "Sense: End-of-data at frame %ld. Advancing 5 frames...\n", CurrentFrame);
-					if (false == pOnStream->Locate(CurrentFrame += 5)) {
-						Debug(0, "main: Locate failed: '%s'\n", szOnStreamErrors[pOnStream->GetLastError()]);
-						delete pOnStream;
-						return 1;
-					}
-					WaitForReady(pOnStream);
-					if (false == pOnStream->StartRead()) {
-						Debug(0, "main: Read failed: '%s'\n", szOnStreamErrors[pOnStream->GetLastError()]);
-						delete pOnStream;
-						return 1;
-					}
-					WaitForReady(pOnStream);
+					/* There may be data behind a bad stretch or a write
+					 * error skip: find the frame we want by its number */
+					Debug(2, "%s at frame %ld. Looking for sequence number %lu...\n", 
+					      CurrentSense == SEOD ? "End-of-data" : "Unrecoverable read error", 
+					      CurrentFrame, CurrentSeqNo);
+					CurrentFrame += CurrentSense == STimeoutWaitPos ? 40 : 1;
+					if (!RecoverRead(pOnStream, &ReadAhead, rbuf, WritePass, &CurrentSeqNo, 
+							 LastGood, &CurrentFrame, &pending, &Lost))
+						eof = 1;
 					continue;
 				default:
 					Debug(0, "Unhandled sense %d\n", CurrentSense);
 					return -1;
 				}
 				CurrentFrame++;
-				unFormatAuxFrame(&buf[32768], &AuxFrame);
+				unFormatAuxFrame(&frame[32768], &AuxFrame);
 				switch (AuxFrame.FrameType) {
 				case 0x8000:
 					// Data frame
@@ -2426,43 +6139,64 @@ int main(int argc, char* argv[])
 						Debug(2, "Frame with low sequence number %ld. Expecting %ld. Skipping...\n", AuxFrame.FrameSequenceNumber, CurrentSeqNo);
 						continue;
 					}
-					/* The skip 80 forward could have been too far ... */
+					/* We missed some, go back and look for them */
 					if (AuxFrame.FrameSequenceNumber > CurrentSeqNo) {
-						Debug(0, "Frame with high sequence number %ld. Expecting %ld. ", AuxFrame.FrameSequenceNumber, CurrentSeqNo);
-						if (retry++ > 5) {
+						Debug(1, "Frame with high sequence number %ld at %d. Expecting %ld.\n", 
+						      AuxFrame.FrameSequenceNumber, CurrentFrame - 1, CurrentSeqNo);
+						CurrentFrame--;
+						if (!RecoverRead(pOnStream, &ReadAhead, rbuf, WritePass, &CurrentSeqNo, 
+								 LastGood, &CurrentFrame, &pending, &Lost))
 							eof = 1;
-							Debug (0, "Aborting\n");
-							break;
-						}
-						CurrentFrame -= AuxFrame.FrameSequenceNumber - CurrentSeqNo + 1;
-						Debug (0, "Jump Back to %i.\n", CurrentFrame);
-						if (CurrentFrame > second_cfg && CurrentFrame <= second_cfg + 5) {
-							if (adr_version < 10004) CurrentFrame -= 6;
-							else CurrentFrame -= 5;
-						}
-						if (false == pOnStream->Locate(CurrentFrame)) {
-							Debug(0, "main: Locate failed: '%s'\n", szOnStreamErrors[pOnStream->GetLastError()]);
-							delete pOnStream;
-							return 1;
-						}
-						if (false == pOnStream->StartRead()) {
-							Debug(0, "main: Read failed: '%s'\n", szOnStreamErrors[pOnStream->GetLastError()]);
-							delete pOnStream;
-							return 1;
-						}
-						WaitForReady(pOnStream);
 						continue;
 					}
 
-					CurrentSeqNo++; retry = 0;
-					fwrite(buf, 1, AuxFrame.DataAccessTable.DataAccessTableEntry[0].size, fil);
+					CurrentSeqNo++;
+					LastGood = CurrentFrame;
+					if (nStripes > 1 && !stripeid) {
+						if (!SendStripeID(&AuxFrame, fil))
+							return 1;
+						stripeid = true;
+					}
+					if (AuxFrame.DataAccessTable.DataAccessTableEntry[0].flags & DAT_COMPRESSED) {
+						/* Frames without a sync are taken to start with a block */
+						if (!Decompress(&Inflate, frame, AuxFrame.DataAccessTable.DataAccessTableEntry[0].size, 
+								AuxFrame.FrameSequenceNumber, 
+								memcmp(&AuxFrame.DriverUnique[16], COMPRESS_MAGIC, 4) ? 0 : 
+								BE32(&AuxFrame.DriverUnique[20]))) {
+							Debug(0, "Write to output file failed: %s\n", strerror(errno));
+							broken = true;
+							eof = 1;
+						}
+					} else if (pipeline) {
+						if (frame != rbuf)
+							memcpy(rbuf, frame, AuxFrame.DataAccessTable.DataAccessTableEntry[0].size);
+						FrameQueueCommit(&OutQueue, AuxFrame.DataAccessTable.DataAccessTableEntry[0].size);
+					} else if (!OutputCommit(&Output, frame, AuxFrame.DataAccessTable.DataAccessTableEntry[0].size))
+						Debug(0, "Write to output file failed: %s\n", strerror(errno));
 					totalBytes += AuxFrame.DataAccessTable.DataAccessTableEntry[0].size;
+					if (StopSeqNo && CurrentSeqNo >= StopSeqNo)
+						eof = 1;
+					break;
+				case 0x0200:
+					Debug(2, "Filemark at frame %d\n", CurrentFrame - 1);
+					if (AuxFrame.PartitionDescription.WritePassCounter != WritePass
+					    || AuxFrame.FrameSequenceNumber != CurrentSeqNo)
+						break;
+					/* Filemarks take a sequence number too */
+					CurrentSeqNo++;
+					LastGood = CurrentFrame;
+					/* A single file ends here */
+					if (restorefile >= 0) eof = 1;
 					break;
 				case 0x0100:
+					/* Ignore EOD frames left by an earlier write pass, 
+					 * there may be more of ours behind them */
+					if (AuxFrame.PartitionDescription.WritePassCounter != WritePass) {
+						Debug(2, "Old EOD frame at %d. Skipping...\n", CurrentFrame - 1);
+						break;
+					}
 					Debug(2, "EOD\n");
-					/* Ignore EOD frames if in error recovery, 
-					 * i.e. locating forward to find next valid frame */
-					if (!retry) eof = 1;
+					eof = 1;
 					break;
 				default:
 					Debug(2, "Unknown frame 0x%04x at pos %d. Skipping.\n", 
@@ -2471,6 +6205,15 @@ int main(int argc, char* argv[])
 				}
 			}
 			//fclose(DebugFile);
+			CancelReadAhead(pOnStream, &ReadAhead);
+			if (pipeline)
+				StopFrameQueue(&OutQueue, IOThread);
+			if (!OutputClose(&Output))
+				Debug(0, "Write to output file failed: %s\n", strerror(errno));
+			if (Inflate.nBytes)
+				Debug(1, "Decompressed %Lu bytes to %Lu\n", totalBytes, Inflate.nBytes);
+			free(Inflate.In);
+			free(Inflate.Out);
 			if (NULL != filename) {
 				fclose(fil);
 			}
@@ -2486,7 +6229,17 @@ int main(int argc, char* argv[])
 				WaitForReady(pOnStream);
 				Debug(2, "Done.\n");
 			}
-			return 0;
+			if (Inflate.nDropped)
+				Debug(0, "%lu compressed blocks dropped\n", Inflate.nDropped);
+			if (Lost.nFrames) {
+				Debug(0, "%lu logical frames lost in %u stretches\n", Lost.nFrames, Lost.nRanges);
+				return 1;
+			}
+			if (Lost.fGaveUp) {
+				Debug(0, "No EOD found, the restore may be incomplete\n");
+				return 1;
+			}
+			return broken || Inflate.nDropped ? 1 : 0;
 
 		}
 
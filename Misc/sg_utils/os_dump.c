@@ -4,6 +4,11 @@
  * (c) 2000 Kurt Garloff <garloff@suse.de>
  * heavily based on Doug Gilbert's sg_rbuf program.
  * (c) 1999 Doug Gilbert
+ *
+ * Several READs are kept queued in the sg driver (told apart by their
+ * pack_id), into a fixed pool of frame buffers, while a second thread
+ * writes the frames out (and their AUX fields to an index, with -i).
+ * With -c, the output is an indexed image (see os_image.h).
  * 
  *  This program is free software; you can redistribute it and/or modify
  *  it under the terms of the GNU General Public License as published by
@@ -19,13 +24,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <linux/../scsi/sg.h>		/* cope with silly includes */
 #include <linux/../scsi/scsi.h>		/* SCSI commands */
+#include <arpa/inet.h>
 #include "sg_err.h"
+#include "os_image.h"
 
 #define BPI (signed)(sizeof(int))
 
@@ -33,6 +41,11 @@
 #define RB_MODE_DESC 3
 #define RB_MODE_DATA 2
 #define RB_DESC_LEN 4
+/* The AUX follows the 32k of data in an OnStream frame */
+#define AUX_OFF OS_IMG_AUX
+#define AUX_LEN 512
+/* Sleep of the reader waiting for buffers, or the writer for frames, in us */
+#define POOL_POLL 1000
 
 const unsigned char rdCmdBlk [6] = {READ_6, 1, 0, 0, 0, 0};
 const unsigned char lcCmdBlk[10] = {SEEK_10, 0, 0, 0, 0, 0, 0, 0, 0, 0};
@@ -53,8 +66,27 @@ int bufsz = 33280;
 char *file_name = 0;
 int ctr = 0;
 int startpos = 0;
+int depth = 4;
+int nbufs = 16;
+char *index_name = 0;
+char container = 0;
 
-int do_cmnd (int sg_fd, unsigned char *buf, int outln, int inln, char *errtext)
+/* The pool: frame n (counted from startpos) goes to frames[n % nbufs].
+ * Frames below filled are read, those below written are out. */
+struct frame {
+	unsigned char *buf;
+	int ppos;
+	char bad;
+} *frames;
+unsigned int filled = 0, written = 0;
+int reading = 1;
+FILE *indexf;
+/* -c: status bits and index of the image, written after the frames */
+unsigned char *badmap;
+struct os_image_ent *marks;
+int nmarks = 0;
+
+int send_cmnd (int sg_fd, unsigned char *buf, int outln, char *errtext)
 {
 	int res;
         res = write(sg_fd, buf, outln);
@@ -68,7 +100,13 @@ int do_cmnd (int sg_fd, unsigned char *buf, int outln, int inln, char *errtext)
 		    prog, errtext, outln, res);
             return 2;
         }
-        
+	return 0;
+}
+
+/* With SG_SET_FORCE_PACK_ID, this gets the reply to the pack_id in buf */
+int recv_cmnd (int sg_fd, unsigned char *buf, int inln, char *errtext)
+{
+	int res;
         res = read(sg_fd, buf, inln);
         if (res < 0) {
 	    fprintf (stderr, "%s: read (%s)", prog, errtext);
@@ -82,6 +120,13 @@ int do_cmnd (int sg_fd, unsigned char *buf, int outln, int inln, char *errtext)
         }
 	return 0;
 }
+
+int do_cmnd (int sg_fd, unsigned char *buf, int outln, int inln, char *errtext)
+{
+	int res = send_cmnd (sg_fd, buf, outln, errtext);
+	if (res) return res;
+	return recv_cmnd (sg_fd, buf, inln, errtext);
+}
 	
 
 void output (unsigned char *buf, int ln)
@@ -89,11 +134,104 @@ void output (unsigned char *buf, int ln)
 	int pos = 0; int res;
 	while (pos < ln) {
 		res = write (1, buf+pos, ln-pos);
-		if (res < 0) perror ("os_dump: write stdout");
+		if (res < 0) {
+			perror ("os_dump: write stdout");
+			exit (5);
+		}
 		pos += res;
 	}
 }
 
+static unsigned int be32 (const unsigned char *p)
+{
+	return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/* One line of the index per frame: where it came from, and its AUX */
+void index_frame (struct frame *fr)
+{
+	const unsigned char *aux = fr->buf + OFF + AUX_OFF;
+	int i, cnt = 0;
+
+	for (i = 0; i < aux[58] && i < 16; i++)
+		cnt += (aux[64 + 8*i] << 8) | aux[65 + 8*i];
+	fprintf (indexf, "%8i %-4s %02x %5i %8u %8u %2i %6u %5i %02x %5u\n",
+		 fr->ppos, fr->bad? "bad": "ok", aux[16], (aux[22] << 8) | aux[23],
+		 be32 (aux + 44), be32 (aux + 52), aux[58], aux[58]? be32 (aux + 60): 0, 
+		 cnt, aux[58]? aux[66]: 0, be32 (aux + 192));
+}
+
+/* -c: note a frame for the image's status bits and index */
+void image_frame (struct frame *fr, int n)
+{
+	const unsigned char *aux = fr->buf + OFF + AUX_OFF;
+	uint32_t type = fr->bad? 0: os_img_type (aux);
+
+	if (fr->bad) badmap[n / 8] |= 1 << (n % 8);
+	if (!type) return;
+	if (!(nmarks % 64)) marks = realloc (marks, (nmarks + 64) * sizeof (*marks));
+	if (!marks) {
+		fprintf (stderr, "os_dump: out of memory for the image index\n");
+		exit (5);
+	}
+	marks[nmarks].ppos = htonl (fr->ppos);
+	marks[nmarks].type = htonl (type);
+	marks[nmarks].seq  = htonl (be32 (aux + 44));
+	marks[nmarks].lbn  = htonl (be32 (aux + 52));
+	nmarks++;
+}
+
+/* -c: the image header goes before the frames */
+void image_start ()
+{
+	unsigned char hdr[OS_IMG_ALIGN];
+	struct os_image_hdr *ih = (struct os_image_hdr *)hdr;
+
+	memset (hdr, 0, sizeof (hdr));
+	memcpy (ih->magic, OS_IMG_MAGIC, sizeof (ih->magic));
+	ih->version    = htonl (OS_IMG_VERSION);
+	ih->frame_size = htonl (bufsz);
+	ih->first_ppos = htonl (startpos);
+	ih->nframes    = htonl (no);
+	output (hdr, sizeof (hdr));
+}
+
+/* -c: and the status bits and index after them */
+void image_end ()
+{
+	struct os_image_idx idx;
+
+	memset (&idx, 0, sizeof (idx));
+	idx.count = htonl (nmarks);
+	output (badmap, os_img_index_off (no, bufsz) - os_img_status_off (no, bufsz));
+	output ((unsigned char *)&idx, sizeof (idx));
+	if (nmarks) output ((unsigned char *)marks, nmarks * sizeof (*marks));
+}
+
+/* Writer thread: output the frames in turn as they come in */
+void * writer (void * arg)
+{
+	struct frame *fr;
+
+	if (container) image_start ();
+	while (1) {
+		if (written == __atomic_load_n (&filled, __ATOMIC_ACQUIRE)) {
+			if (!__atomic_load_n (&reading, __ATOMIC_ACQUIRE)
+			    && written == __atomic_load_n (&filled, __ATOMIC_ACQUIRE))
+				break;
+			usleep (POOL_POLL);
+			continue;
+		}
+		fr = frames + written % nbufs;
+		output (fr->buf + OFF, bufsz);
+		if (indexf) index_frame (fr);
+		if (container) image_frame (fr, written);
+		__atomic_store_n (&written, written + 1, __ATOMIC_RELEASE);
+	}
+	if (container) image_end ();
+	return arg;
+}
+
 int do_locate (int sg_fd, int pos)
 {
 	int res;
@@ -172,17 +310,19 @@ int onstream_appid (int sg_fd)
 }
 
 
-int do_read (int sg_fd, int size, int pos, char pr)
+/* Wait until the drive has frame pos in its buffer; returns the frame
+ * after its last buffered one, or -1 */
+int wait_frame (int sg_fd, int pos)
 {
 	int res;
-	unsigned char * rbBuff = malloc(OFF + 12 + size);
+	unsigned char * rbBuff = malloc(OFF + 20);
 	struct sg_header * rsghp = (struct sg_header *)rbBuff;
 	int fblk, lblk;
 	int rbInLen = OFF + 20;
 	int rbOutLen = OFF + sizeof (rpCmdBlk);
 	
     loop:
-	memset(rbBuff, 0, OFF + 12 + size);
+	memset(rbBuff, 0, OFF + 20);
 	rsghp->pack_len = 0;                /* don't care */
 	rsghp->reply_len = rbInLen;
 	rsghp->twelve_byte = 0;
@@ -190,7 +330,7 @@ int do_read (int sg_fd, int size, int pos, char pr)
 	memcpy(rbBuff + OFF, rpCmdBlk, sizeof(rpCmdBlk));
 	rsghp->pack_id = pos*2;
 	res = do_cmnd (sg_fd, rbBuff, rbOutLen, rbInLen, "read pos");
-	if (res) return res;
+	if (res) { free (rbBuff); return -1; }
 	fblk = ((rbBuff + OFF)[4] << 24)
 		+ ((rbBuff + OFF)[5] << 16)
 		+ ((rbBuff + OFF)[6] << 8)
@@ -206,51 +346,96 @@ int do_read (int sg_fd, int size, int pos, char pr)
 		sleep (1);
 		goto loop;
 	}
-	/* read */
-	rbInLen = OFF + size;
-	rbOutLen = OFF + sizeof (rdCmdBlk);
-	memset(rbBuff, 0, OFF + 12 + size);
+	free (rbBuff);
+	return lblk;
+}
+
+/* Queue the READ of frame pos into its buffer */
+int submit_read (int sg_fd, struct frame *fr, int pos)
+{
+	unsigned char * rbBuff = fr->buf;
+	struct sg_header * rsghp = (struct sg_header *)rbBuff;
+
+	memset(rbBuff, 0, OFF + bufsz);
 	rsghp->pack_len = 0;                /* don't care */
-	rsghp->reply_len = rbInLen;
+	rsghp->reply_len = OFF + bufsz;
 	rsghp->twelve_byte = 0;
 	rsghp->result = 0;
 	memcpy(rbBuff + OFF, rdCmdBlk, sizeof(rdCmdBlk));
-	//rbBuff[OFF + 2] = 0xff & (size >> 16);
-	//rbBuff[OFF + 3] = 0xff & (size >> 8);
-	//rbBuff[OFF + 4] = 0xff & (size);
 	rbBuff[OFF + 4] = 1;
-
 	rsghp->pack_id = pos*2+1;
-	res = do_cmnd (sg_fd, rbBuff, rbOutLen, rbInLen, "data");
-	if (pr) output (rbBuff+OFF, size);
-	if (rbBuff) free(rbBuff);
-	return res;
+	fr->ppos = pos;
+	return send_cmnd (sg_fd, rbBuff, OFF + sizeof (rdCmdBlk), "data");
+}
+
+/* Collect the queued READ of a frame. A frame the drive failed to read
+ * is passed on zeroed and marked bad in the index. */
+int finish_read (int sg_fd, struct frame *fr)
+{
+	unsigned char * rbBuff = fr->buf;
+	struct sg_header * rsghp = (struct sg_header *)rbBuff;
+	int res, cat;
+
+	res = recv_cmnd (sg_fd, rbBuff, OFF + bufsz, "data");
+	if (res) return res;
+	cat = sg_err_category (rsghp->target_status, rsghp->host_status,
+			       rsghp->driver_status, rsghp->sense_buffer, SG_MAX_SENSE);
+	fr->bad = rsghp->result || (cat != SG_ERR_CAT_CLEAN && cat != SG_ERR_CAT_RECOVERED);
+	if (fr->bad) {
+		fprintf (stderr, "os_dump: frame %i unreadable\n", fr->ppos);
+		memset (rbBuff + OFF, 0, bufsz);
+	}
+	return 0;
 }
 
 
 void usage ()
 {
-	fprintf (stderr, "Usage: os_dump /dev/sgX no [locate] [blksz]\n");
+	fprintf (stderr, "Usage: os_dump [-q depth] [-n bufs] [-i index] [-c] /dev/sgX no [locate] [blksz]\n");
 	fprintf (stderr, "os_dump reads data in chunks of 33280 (blksz) bytes from device\n");
 	fprintf (stderr, " /dev/sgX and writes it to standard output. This is done for\n");
 	fprintf (stderr, " no blocks.\n");
+	fprintf (stderr, " -q keeps up to depth (4) READs queued, -n reads into bufs (16) buffers,\n");
+	fprintf (stderr, " -i writes the AUX fields of each frame to the file index.\n");
+	fprintf (stderr, " -c writes an indexed image, with the unreadable frames and the\n");
+	fprintf (stderr, "    header, filemark and EOD positions, instead of plain frames.\n");
 	fprintf (stderr, "(c) Douglas Gilbert, Kurt Garloff, 2000, GNU GPL\n");
 	exit (1);
 }
 
 void parseargs (int argc, char *argv[])
 {
-	if (argc < 3) usage ();
-	file_name = argv[1];
-	no = atol (argv[2]);
-	if (argc > 3) startpos = atol (argv[3]);
-	if (argc > 4) bufsz = atol (argv[4]);
+	int c;
+	while ((c = getopt (argc, argv, "q:n:i:c")) != -1)
+		switch (c) {
+		  case 'q': depth = atol (optarg); break;
+		  case 'n': nbufs = atol (optarg); break;
+		  case 'i': index_name = optarg; break;
+		  case 'c': container = 1; break;
+		  default: usage ();
+		}
+	argc -= optind; argv += optind;
+	if (argc < 2 || depth < 1 || nbufs < depth) usage ();
+	file_name = argv[0];
+	no = atol (argv[1]);
+	if (argc > 2) startpos = atol (argv[2]);
+	if (argc > 3) bufsz = atol (argv[3]);
+	if (index_name && bufsz < AUX_OFF + AUX_LEN) {
+		fprintf (stderr, "os_dump: no AUX to index in %i byte blocks\n", bufsz);
+		exit (1);
+	}
+	if (container && (bufsz != OS_IMG_FRAME || no < 0)) {
+		fprintf (stderr, "os_dump: images hold whole frames of %i bytes\n", OS_IMG_FRAME);
+		exit (1);
+	}
 }
 
 
 int main (int argc, char * argv[])
 {
-	int sg_fd; int res;
+	int sg_fd; int res; int one = 1;
+	int i, issued = 0, ready = 0;
+	pthread_t wthread;
    
 	parseargs (argc, argv);
 	sg_fd = open(file_name, O_RDWR);
@@ -270,11 +455,63 @@ int main (int argc, char * argv[])
 	if (res) fprintf (stderr, "os_dump: mode_select failed!\n");
 	res = do_locate (sg_fd, startpos);
 	if (res) fprintf (stderr, "os_dump: locate failed!\n");
-	while (no--) {
-		res = do_read (sg_fd, bufsz, startpos+ctr, 1);
-		if (res) return (4);
-		ctr++;
+
+	/* Replies by pack_id, in the order we queued the commands */
+	if (ioctl (sg_fd, SG_SET_COMMAND_Q, &one) < 0
+	    || ioctl (sg_fd, SG_SET_FORCE_PACK_ID, &one) < 0) {
+		fprintf (stderr, "os_dump: can't queue commands, reading one at a time\n");
+		depth = 1;
+	}
+	if (index_name) {
+		indexf = fopen (index_name, "w");
+		if (!indexf) {
+			perror ("os_dump: open index");
+			return 1;
+		}
+		fprintf (indexf, "#   ppos stat ty  pass      seq      lbn ne  blksz  blks fl fmcnt\n");
+	}
+	if (container && !(badmap = calloc (1, os_img_index_off (no, bufsz) 
+						   - os_img_status_off (no, bufsz) + 1))) {
+		fprintf (stderr, "os_dump: buffer malloc() failed!\n");
+		return 1;
+	}
+	frames = calloc (nbufs, sizeof (struct frame));
+	for (i = 0; frames && i < nbufs; i++)
+		if (!(frames[i].buf = malloc (OFF + bufsz))) break;
+	if (!frames || i < nbufs) {
+		fprintf (stderr, "os_dump: buffer malloc() failed!\n");
+		return 1;
+	}
+	if (pthread_create (&wthread, 0, writer, 0)) {
+		fprintf (stderr, "os_dump: can't start writer thread!\n");
+		return 1;
+	}
+	while (ctr < no) {
+		/* Queue reads of what the drive has buffered, as far as the
+		 * queue and the free buffers allow */
+		while (issued < no && startpos+issued < ready && issued - ctr < depth
+		       && issued - __atomic_load_n (&written, __ATOMIC_ACQUIRE) < nbufs) {
+			if (submit_read (sg_fd, frames + issued % nbufs, startpos+issued))
+				return 4;
+			issued++;
+		}
+		if (ctr < issued) {
+			if (finish_read (sg_fd, frames + ctr % nbufs)) return 4;
+			ctr++;
+			__atomic_store_n (&filled, ctr, __ATOMIC_RELEASE);
+			continue;
+		}
+		/* Nothing queued: the output is behind, or we need more frames */
+		if (issued - __atomic_load_n (&written, __ATOMIC_ACQUIRE) >= nbufs) {
+			usleep (POOL_POLL);
+			continue;
+		}
+		ready = wait_frame (sg_fd, startpos+issued);
+		if (ready < 0) return 4;
 	}
+	__atomic_store_n (&reading, 0, __ATOMIC_RELEASE);
+	pthread_join (wthread, 0);
+	if (indexf && fclose (indexf)) perror ("os_dump: close index");
 
 	res = close(sg_fd);
 	if (res < 0) {
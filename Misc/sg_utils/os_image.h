@@ -0,0 +1,82 @@
+/* os_image.h */
+/*
+ * Indexed image of an OnStream tape, as written by os_dump -c and read
+ * by os_write -I and osg -E. All numbers are big endian, as on tape.
+ *
+ *   0           struct os_image_hdr, padded to OS_IMG_ALIGN
+ *   frames      nframes frames of frame_size bytes (data, then AUX);
+ *               frame i is the one at physical position first_ppos + i
+ *   status      a bit per frame (LSB first), set if the frame could not
+ *               be read; such a frame is stored zeroed
+ *   index       struct os_image_idx, then count struct os_image_ent of
+ *               the header, filemark and EOD frames, in tape order
+ *
+ * The sections are found from nframes and frame_size alone and the frames
+ * start on a page, so a reader can mmap() the image and go to any frame
+ * right away. Status and index come after the frames, so the image can
+ * be written to a pipe.
+ *
+ * Copyright: GNU GPL
+ * $Id$
+ */
+
+#ifndef _OS_IMAGE_H
+#define _OS_IMAGE_H
+
+#include <stdint.h>
+
+#define OS_IMG_MAGIC "OSTIMAGE"
+#define OS_IMG_VERSION 1
+#define OS_IMG_ALIGN 4096
+#define OS_IMG_FRAME 33280
+#define OS_IMG_AUX (32 * 1024)
+
+/* Index entry types, from the frame type in the AUX */
+#define OS_IMG_HEADER 1
+#define OS_IMG_FILEMARK 2
+#define OS_IMG_EOD 3
+
+struct os_image_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t frame_size;
+	uint32_t first_ppos;
+	uint32_t nframes;
+	uint32_t reserved[10];
+};
+
+struct os_image_idx {
+	uint32_t count;
+	uint32_t reserved;
+};
+
+struct os_image_ent {
+	uint32_t ppos;
+	uint32_t type;
+	uint32_t seq;		/* frame sequence number */
+	uint32_t lbn;		/* logical block number */
+};
+
+/* Where the sections start, from the (host order) header values */
+static inline uint64_t os_img_status_off (uint32_t nframes, uint32_t frame_size)
+{
+	return OS_IMG_ALIGN + (uint64_t) nframes * frame_size;
+}
+
+static inline uint64_t os_img_index_off (uint32_t nframes, uint32_t frame_size)
+{
+	return os_img_status_off (nframes, frame_size) + ((nframes + 63) / 64) * 8;
+}
+
+/* The index type of a frame, by its AUX; 0 for data and filler */
+static inline uint32_t os_img_type (const unsigned char *aux)
+{
+	switch (aux[16]) {
+	  case 0x08: return OS_IMG_HEADER;
+	  case 0x02: return OS_IMG_FILEMARK;
+	  case 0x01: return OS_IMG_EOD;
+	  default:   return 0;
+	}
+}
+
+#endif
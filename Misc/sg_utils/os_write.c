@@ -4,6 +4,7 @@
  * (c) 2000 Kurt Garloff <garloff@suse.de>
  * heavily based on Doug Gilbert's sg_rbuf program.
  * (c) 1999 Doug Gilbert
+ * With -I, the frames come from an indexed image (see os_image.h).
  * 
  *  This program is free software; you can redistribute it and/or modify
  *  it under the terms of the GNU General Public License as published by
@@ -24,9 +25,12 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
 #include <linux/../scsi/sg.h>		/* cope with silly includes */
 #include <linux/../scsi/scsi.h>		/* SCSI commands */
 #include "sg_err.h"
+#include "os_image.h"
 
 #define BPI (signed)(sizeof(int))
 
@@ -54,6 +58,10 @@ int bufsz = 33280;
 char *file_name = 0;
 int ctr = 0;
 int startpos = 0;
+/* -I: the image, mapped, and its header values in host order */
+char *image_name = 0;
+unsigned char *image;
+uint32_t img_first, img_frames;
 
 int do_cmnd (int sg_fd, unsigned char *buf, int outln, int inln, char *errtext)
 {
@@ -102,6 +110,75 @@ int input (unsigned char *buf, int ln)
 	return 0;
 }
 
+/* -I: map the image, check it is whole, and tell what its index holds */
+void open_image ()
+{
+	struct os_image_hdr *ih;
+	struct os_image_idx *idx;
+	struct os_image_ent *ent;
+	struct stat st;
+	uint64_t ioff;
+	uint32_t i, count, fsz, hdrs = 0, fms = 0;
+	int fd = open (image_name, O_RDONLY);
+
+	if (fd < 0 || fstat (fd, &st) < 0) {
+		perror ("os_write: open image");
+		exit (1);
+	}
+	if (st.st_size < OS_IMG_ALIGN
+	    || (image = mmap (0, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		fprintf (stderr, "os_write: %s is no image\n", image_name);
+		exit (1);
+	}
+	close (fd);
+	ih = (struct os_image_hdr *)image;
+	img_first = ntohl (ih->first_ppos);
+	img_frames = ntohl (ih->nframes);
+	fsz = ntohl (ih->frame_size);
+	ioff = os_img_index_off (img_frames, fsz);
+	if (memcmp (ih->magic, OS_IMG_MAGIC, sizeof (ih->magic)) 
+	    || ntohl (ih->version) != OS_IMG_VERSION || fsz != OS_IMG_FRAME
+	    || st.st_size < ioff + sizeof (*idx)) {
+		fprintf (stderr, "os_write: %s is no image, or truncated\n", image_name);
+		exit (1);
+	}
+	idx = (struct os_image_idx *)(image + ioff);
+	count = ntohl (idx->count);
+	if (st.st_size < ioff + sizeof (*idx) + (uint64_t) count * sizeof (*ent)) {
+		fprintf (stderr, "os_write: %s is truncated\n", image_name);
+		exit (1);
+	}
+	ent = (struct os_image_ent *)(idx + 1);
+	fprintf (stderr, "os_write: image of %u frames from %u,", img_frames, img_first);
+	for (i = 0; i < count; i++)
+		switch (ntohl (ent[i].type)) {
+		  case OS_IMG_HEADER: hdrs++; break;
+		  case OS_IMG_FILEMARK: fms++; break;
+		  case OS_IMG_EOD:
+			fprintf (stderr, " EOD at %u,", ntohl (ent[i].ppos));
+			break;
+		}
+	fprintf (stderr, " %u header frames, %u filemarks\n", hdrs, fms);
+	bufsz = fsz;
+}
+
+/* -I: copy the frame for pos from the image; those it lacks are an error,
+ * unreadable ones go out zeroed as they are stored */
+int image_input (unsigned char *buf, int pos)
+{
+	unsigned int n = pos - img_first;
+	unsigned char *bad = image + os_img_status_off (img_frames, bufsz);
+
+	if (pos < img_first || n >= img_frames) {
+		fprintf (stderr, "os_write: frame %i is not in the image\n", pos);
+		return 1;
+	}
+	if (bad[n / 8] & (1 << (n % 8)))
+		fprintf (stderr, "os_write: frame %i was unreadable, writing it zeroed\n", pos);
+	memcpy (buf, image + OS_IMG_ALIGN + (uint64_t) n * bufsz, bufsz);
+	return 0;
+}
+
 int do_locate (int sg_fd, int pos)
 {
 	int res;
@@ -211,7 +288,15 @@ int do_write (int sg_fd, int size, int pos, char pr)
 	rbInLen = OFF;
 	rbOutLen = OFF + sizeof (wrCmdBlk) + size;
 	memset(rbBuff, 0, OFF + 12 + size);
-	res = input (rbBuff + OFF + sizeof (wrCmdBlk), size);
+	if (image) {
+		/* Never put a frame we do not have on tape */
+		if (image_input (rbBuff + OFF + sizeof (wrCmdBlk), pos)) {
+			free (rbBuff);
+			return 1;
+		}
+		res = 0;
+	} else
+		res = input (rbBuff + OFF + sizeof (wrCmdBlk), size);
 	rsghp->pack_len = 0;                /* don't care */
 	rsghp->reply_len = rbInLen;
 	rsghp->twelve_byte = 0;
@@ -233,20 +318,36 @@ int do_write (int sg_fd, int size, int pos, char pr)
 void usage ()
 {
 	fprintf (stderr, "Usage: os_write /dev/sgX no [locate] [blksz]\n");
+	fprintf (stderr, "       os_write -I image /dev/sgX [no] [locate]\n");
 	fprintf (stderr, "os_write writes data in chunks of 33280 (blksz) bytes to device\n");
 	fprintf (stderr, " /dev/sgX. Data is read from standard output. This is done for\n");
 	fprintf (stderr, " no blocks.\n");
+	fprintf (stderr, " With -I, the frames of an os_dump -c image are written back to\n");
+	fprintf (stderr, " where they came from (all of them by default).\n");
 	fprintf (stderr, "(c) Douglas Gilbert, Kurt Garloff, 2000, GNU GPL\n");
 	exit (1);
 }
 
 void parseargs (int argc, char *argv[])
 {
-	if (argc < 3) usage ();
-	file_name = argv[1];
-	no = atol (argv[2]);
-	if (argc > 3) startpos = atol (argv[3]);
-	if (argc > 4) bufsz = atol (argv[4]);
+	int c;
+	while ((c = getopt (argc, argv, "I:")) != -1)
+		switch (c) {
+		  case 'I': image_name = optarg; break;
+		  default: usage ();
+		}
+	argc -= optind; argv += optind;
+	if (argc < (image_name? 1: 2)) usage ();
+	file_name = argv[0];
+	if (image_name) {
+		open_image ();
+		startpos = argc > 2? atol (argv[2]): img_first;
+		no = argc > 1? atol (argv[1]): img_first + img_frames - startpos;
+		return;
+	}
+	no = atol (argv[1]);
+	if (argc > 2) startpos = atol (argv[2]);
+	if (argc > 3) bufsz = atol (argv[3]);
 }
 
 
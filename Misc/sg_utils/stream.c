@@ -4,6 +4,18 @@
  * It's useful to provide a buffer for apps that don't 
  * provide a buffer, but should, like eg. tar when dealing
  * with tapes
+ * Input and output are done by two threads sharing a ring
+ * buffer, so a device blocking on one side (osst ignores
+ * O_NONBLOCK) does not hold up the other.
+ * With -Z, the data go through a kernel pipe by splice(),
+ * where the endpoints allow it.
+ * With -M, several inputs are interleaved into one output
+ * in records with a small header; -D splits them again.
+ * Further outputs get the same data, each written by a thread
+ * of its own, so a slow one only holds up the rest once the
+ * buffer is full.
+ * With -T, samples of the buffer fill and the rates go to a
+ * file or unix socket as JSON lines, and a summary at the end.
  */
 
 /*
@@ -12,22 +24,59 @@
  * $Id$
  */
 
-#define VERSION "0.50"
+#define VERSION "0.60"
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <ctype.h>
+#include <pthread.h>
 #include <sys/fcntl.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <poll.h>
 #include <signal.h>
 #include <errno.h>
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* Mux records: "MX", input number (16 bit), length (32 bit), both
+ * big endian, then the data. Length 0 ends an input. */
+#define MUXHDR 8
+#define MAX_MUX 16
+/* outputs besides fdout */
+#define MAX_TEE 8
+
+/* Stalls are counted in the telemetry summary by their length,
+ * below 1ms, 10ms, 100ms, 1s, 10s and longer */
+#define STALL_BINS 6
+/* and samples by the buffer fill, in 10% steps */
+#define FILL_BINS 10
+
+/* Sleep of a side waiting for the other one, in us */
+#define RING_POLL 1000
+/* Auto-tuned watermarks (-A) are recomputed this often (s). They leave
+ * room for HIGH_SECS of input when the writer starts and keep up to
+ * LOW_SECS of output in the buffer when it stops; at least half of the
+ * buffer stays between them, so the output streams for long. */
+#define TUNE_INTERVAL 1.0
+#define LOW_SECS 2
+#define HIGH_SECS 2
 
 unsigned char * buffer;
-unsigned int readpos = 0, writepos = 0, wrappos = 0;
-char full = 0, empty = 1;
+/* buffer is mapped twice in a row, so buffer[bufsize+i] is buffer[i];
+ * otherwise output wrapping around goes through staging */
+char mirrored = 0;
+unsigned char * staging;
+unsigned char * spill;
 
+/* Set by the reader (or a signal) when no more input comes */
 int eof = 0;
 
 /* options */
@@ -39,29 +88,110 @@ char verbose = 0;
 char debug = 0;
 char padbyte = 0;
 char reportlevel = 0;
+unsigned int highpct = 0, lowpct = 0;
+char autotune = 0;
+unsigned int writeblocks = 1;
+char zerocopy = 0;
+char * spillname = 0;
+char mux = 0, demux = 0;
+unsigned long long spillsize = 1024 * 1024 * 1024;
+char * telname = 0;
+double telinterval = 1.0;
 
 int fdin = 0, fdout = 1;
+/* the inputs of -M, the outputs of -D */
+int muxfd[MAX_MUX];
+unsigned int nmux = 0;
+unsigned long long muxtotal[MAX_MUX];
+/* Further outputs, each with its own position in the ring */
+struct tee {
+	int fd;
+	char * name;
+	pthread_t thread;
+	unsigned long long out;
+	unsigned char * staging;
+	unsigned int empty, starts;
+	double stall, writetime;
+} tees[MAX_TEE];
+unsigned int ntee = 0;
 /* counter */
 unsigned long long int readtotal = 0, writetotal = 0;
+/* Data go through the RAM ring, or the spill file when that is full. The
+ * positions are these counters modulo bufsize and spillsize. */
+unsigned long long int ramin = 0, ramout = 0, spillin = 0, spillout = 0;
+/* The reader switched to the spill file at readtotal spillstart and
+ * back at spillstop, spills and unspills times so far */
+unsigned long long int spillstart, spillstop;
+unsigned int spills = 0, unspills = 0;
+unsigned long long int maxram = 0, maxspill = 0;
+/* times a side had to wait for the other and for how long (s) */
+unsigned int wasempty = 0, wasfull = 0;
+double install = 0, outstall = 0;
+unsigned int stallhist[2][STALL_BINS], fillhist[FILL_BINS];
+/* -T: where the samples go (socket or file), set when we are done */
+int telfd = -1;
+char telsock = 0;
+int finished = 0;
+double begin;
+/* output starts writing at highmark and stops below lowmark */
+unsigned int highmark, lowmark;
+unsigned int starts = 0;
+/* time spent in write() (s), to tell the output's rate */
+double writetime = 0;
+/* the pipe -Z moves the data through, and its size */
+int splicepipe[2];
+int pipesize;
 
 void usage (int exitcode)
 {
 	fprintf (stderr, "stream " VERSION " (c) Kurt Garloff <garloff@suse.de>, 3/2000, GNU GPL\n");
-	fprintf (stderr, "Usage: stream [options] [infile] [outfile]\n");
+	fprintf (stderr, "Usage: stream [options] [infile] [outfile ...]\n");
 	fprintf (stderr, "stream read data from infile, buffers it and writes it to outfile\n");
+	fprintf (stderr, "(and to the further outfiles, with the same data)\n");
 	fprintf (stderr, "Options: -b <blk> sets the block  size in 512byte units (tar compat.)\n");
 	fprintf (stderr, "         -B <blk> sets the block  size in bytes (suffixes b,k,m accepted)\n");
 	fprintf (stderr, "         -s <sz>  sets the buffer size in 512byte units\n");
 	fprintf (stderr, "         -S <sz>  sets the buffer size in bytes (suffixes accepted)\n");
 	fprintf (stderr, "         -p pads the output to a full block (optional arg: pad byte)\n");
+	fprintf (stderr, "         -H <pct> start writing only when the buffer is this full\n");
+	fprintf (stderr, "         -L <pct> go on writing until the buffer is less full than this\n");
+	fprintf (stderr, "         -A tunes -H and -L to the input and output rates\n");
+	fprintf (stderr, "         -N <n>   writes up to n blocks at a time\n");
+	fprintf (stderr, "         -Z splices through a kernel pipe (if in- and output allow)\n");
+	fprintf (stderr, "         -F <file> spills over into this file when the buffer is full\n");
+	fprintf (stderr, "         -X <sz>  sets the size of the spill file (suffixes accepted)\n");
+	fprintf (stderr, "         -M muxes: stream -M [options] infile1 infile2 ... outfile\n");
+	fprintf (stderr, "         -D demuxes: stream -D [options] infile outfile1 outfile2 ...\n");
+	fprintf (stderr, "         -T <dst> writes telemetry to file dst (or unix socket unix:path)\n");
+	fprintf (stderr, "         -I <s>   sets the telemetry interval in seconds\n");
 	fprintf (stderr, "         -h displays this little help.\n");
 	fprintf (stderr, "         -v sets verbose mode, -d debug output, -r reports buffer fill.\n");
 	fprintf (stderr, "Defaults: block  size %ik (0: read/write in arbitrary chunks)\n", blksize/1024);
 	fprintf (stderr, "          buffer size %iM\n", bufsize/(1024*1024));
+	fprintf (stderr, "          watermarks 0%% (write whenever a block is there), with -A 75%% 25%%\n");
+	fprintf (stderr, "          spill file size %iM\n", (int)(spillsize/(1024*1024)));
+	fprintf (stderr, "          telemetry interval %.1fs\n", telinterval);
 	fprintf (stderr, "          defaults for infile and outfile are stdin and stdout resp.\n");
 	exit (exitcode);
 }
 
+unsigned long long myatoll (const char * str)
+{
+	unsigned long long ret; char * suff; char c;
+	ret = strtoull (str, &suff, 0);
+	if (!suff) return ret;
+	c = *suff;
+	switch (tolower (c)) {
+	    case 'b': return ret * 512;
+	    case 'k': return ret * 1024;
+	    case 'm': return ret * 1024 *1024;
+	    case 'g': return ret * 1024 *1024 *1024;
+	    case 0: return ret;
+	    default: usage (1);
+	}
+	return 0;
+}
+
 unsigned int myatol (const char * str)
 {
 	unsigned int ret; char * suff; char c;
@@ -78,17 +208,48 @@ unsigned int myatol (const char * str)
 	return 0;
 }
 
+int openin (const char * name)
+{
+	int fd = strcmp (name, "-")? open (name, O_RDONLY): 0;
+	if (fd < 0) {
+		perror ("stream: open  input file");
+		exit (2);
+	}
+	return fd;
+}
+
+int openout (const char * name)
+{
+	int fd = strcmp (name, "-")? open (name, O_WRONLY | O_CREAT /*| O_EXCL*/, 0644): 1;
+	if (fd < 0) {
+		perror ("stream: open output file");
+		exit (2);
+	}
+	return fd;
+}
+
 void parseargs (int argc, char *argv[])
 {
 	int c;
 	char * inname = 0, * outname = 0;
-	while ((c = getopt (argc, argv, ":b:B:s:S:p::hvdr")) != -1)
+	while ((c = getopt (argc, argv, ":b:B:s:S:p::H:L:AN:ZF:X:MDT:I:hvdr")) != -1)
 		switch (c) {
 		  case 'b': blksize = 512 * atol (optarg); break;
 		  case 'B': blksize = myatol (optarg); break;
 		  case 's': bufsize = 512 * atol (optarg); break;
 		  case 'S': bufsize = myatol (optarg); break;
 		  case 'p': pad = 1; if (optarg) padbyte = atol (optarg); break;
+		  case 'H': highpct = atol (optarg); break;
+		  case 'L': lowpct = atol (optarg); break;
+		  case 'A': autotune = 1; break;
+		  case 'Z': zerocopy = 1; break;
+		  case 'F': spillname = optarg; break;
+		  case 'X': spillsize = myatoll (optarg); break;
+		  case 'M': mux = 1; break;
+		  case 'D': demux = 1; break;
+		  case 'T': telname = optarg; break;
+		  case 'I': telinterval = atof (optarg); if (telinterval <= 0) usage (1); break;
+		  case 'N': writeblocks = atol (optarg); if (!writeblocks) usage (1); break;
 		  case 'h': usage (0); break;
 		  case 'v': verbose = 1; break;
 		  case 'd': verbose = 1; debug = 1; break;
@@ -100,23 +261,56 @@ void parseargs (int argc, char *argv[])
 		  default: fprintf (stderr, "stream: getopt error \"%c\"!\n", optopt);
 			abort ();
 		}
+	if (autotune && !highpct) highpct = 75;
+	if (autotune && !lowpct) lowpct = 25;
+	if (highpct > 100 || lowpct > highpct) {
+		fprintf (stderr, "stream: need 0 <= low <= high <= 100 watermarks!\n");
+		usage (1);
+	}
+	if (zerocopy && spillname) {
+		fprintf (stderr, "stream: can't spill when splicing!\n");
+		usage (1);
+	}
+	if ((mux || demux) && (mux + demux > 1 || zerocopy || spillname)) {
+		fprintf (stderr, "stream: -M and -D work with the buffer in RAM only!\n");
+		usage (1);
+	}
+	if (mux) {
+		while (argc - optind > 1 && nmux < MAX_MUX)
+			muxfd[nmux++] = openin (argv[optind++]);
+		if (!nmux || argc - optind != 1) usage (1);
+		outname = argv[optind++];
+		fdout = openout (outname);
+		if (verbose) fprintf (stderr, "stream: mux %i inputs to %s\n", nmux, outname);
+	} else if (demux) {
+		if (argc - optind < 2 || argc - optind > MAX_MUX + 1) usage (1);
+		inname = argv[optind++];
+		fdin = openin (inname);
+		while (argc > optind)
+			muxfd[nmux++] = openout (argv[optind++]);
+		if (verbose) fprintf (stderr, "stream: demux %s to %i outputs\n", inname, nmux);
+	}
+	if (mux || demux) {
+		if (verbose) fprintf (stderr, "   buffer %ik in %i sized blks\n", bufsize/1024, blksize);
+		return;
+	}
 	if (argc > optind) inname  = argv[optind++];
 	if (argc > optind) outname = argv[optind++];
-	if (argc > optind) fprintf (stderr, "stream: ignore spurios arguments!\n");
+	if (argc - optind > MAX_TEE) fprintf (stderr, "stream: ignore spurios arguments!\n");
+	while (argc > optind && ntee < MAX_TEE) {
+		tees[ntee].name = argv[optind++];
+		tees[ntee].fd = openout (tees[ntee].name);
+		ntee++;
+	}
+	if (ntee && (zerocopy || spillname)) {
+		fprintf (stderr, "stream: several outputs work with the buffer in RAM only!\n");
+		usage (1);
+	}
 	
+	if (inname)  fdin  = openin (inname);
+	if (outname) fdout = openout (outname);
 	if (inname  && !strcmp (inname , "-")) inname  = 0;
 	if (outname && !strcmp (outname, "-")) outname = 0;
-	
-	if (inname)  fdin  = open (inname,  O_RDONLY);
-	if (fdin < 0) {
-		perror ("stream: open  input file");
-		exit (2);
-	}
-	if (outname) fdout = open (outname, O_WRONLY | O_CREAT /*| O_EXCL*/, 0644);
-	if (fdout < 0) {
-		perror ("stream: open output file");
-		exit (2);
-	}
 	if (verbose) {
 		fprintf (stderr, "stream: read from %s, write to %s\n   buffer %ik in %i sized blks\n",
 			 inname? inname: "stdin", outname? outname: "stdout",
@@ -125,165 +319,853 @@ void parseargs (int argc, char *argv[])
 	}
 }
 
-inline int inbuf ()
+/* Fill of the ring. The reader only moves readtotal, the writer only
+ * writetotal, so each side can take the other's without locking. */
+static inline unsigned long long inbuf ()
 {
-	return wrappos + readpos - writepos;
+	return __atomic_load_n (&readtotal, __ATOMIC_ACQUIRE)
+		- __atomic_load_n (&writetotal, __ATOMIC_ACQUIRE);
+}
+
+static double now ()
+{
+	struct timeval tv;
+	gettimeofday (&tv, 0);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Map size bytes (a multiple of the page size) of file fd twice, back
+ * to back. Data wrapping around the end are then contiguous, and reads
+ * and writes need not be split there. */
+unsigned char * mapfile (int fd, unsigned long long size)
+{
+	unsigned char * base;
+
+	base = mmap (0, 2*size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base != MAP_FAILED
+	    && (mmap (base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED
+		|| mmap (base+size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)) {
+		munmap (base, 2*size);
+		base = MAP_FAILED;
+	}
+	return base == MAP_FAILED? 0: base;
+}
+
+/* The RAM buffer, mapped that way from a file on tmpfs */
+unsigned char * mirrormap (unsigned int size)
+{
+	char name[] = "/dev/shm/streamXXXXXX";
+	unsigned char * base = 0;
+	int fd = mkstemp (name);
+
+	if (fd < 0) return 0;
+	unlink (name);
+	if (!ftruncate (fd, size))
+		base = mapfile (fd, size);
+	close (fd);
+	return base;
+}
+
+/* The spill file (-F), preallocated, so running out of disk space can't
+ * hit us in the middle */
+unsigned char * spillmap (const char * name, unsigned long long size)
+{
+	unsigned char * base = 0;
+	int fd = open (name, O_RDWR | O_CREAT, 0600);
+
+	if (fd < 0) return 0;
+	if (!posix_fallocate (fd, 0, size))
+		base = mapfile (fd, size);
+	close (fd);
+	return base;
+}
+
+/* Set the watermarks. The writer needs a block to write, and the buffer
+ * may never get quite full with short reads. */
+void setmarks (unsigned long long high, unsigned long long low)
+{
+	/* -M waits for room for a whole record */
+	unsigned int room = bufsize - chunksize - (mux? MUXHDR: 0);
+
+	lowmark = low < chunksize? chunksize: low;
+	if (lowmark > bufsize / 2) lowmark = bufsize / 2;
+	highmark = high > room? room: high;
+	if (highmark < lowmark) highmark = lowmark;
+}
+
+/* -A: place the watermarks from the input rate and the rate of the
+ * output while it writes */
+void tune ()
+{
+	static double last = 0, inrate = 0;
+	static unsigned long long lastread = 0;
+	unsigned long long rt = __atomic_load_n (&readtotal, __ATOMIC_ACQUIRE);
+	double t = now (), outrate, high, low;
+
+	if (!autotune || t - last < TUNE_INTERVAL) return;
+	if (last) inrate = inrate? (3*inrate + (rt - lastread) / (t - last)) / 4
+				 : (rt - lastread) / (t - last);
+	last = t; lastread = rt;
+	if (!inrate || writetime < TUNE_INTERVAL) return;
+	outrate = writetotal / writetime;
+	high = bufsize - inrate * HIGH_SECS;
+	if (high < bufsize / 2) high = bufsize / 2;
+	low = outrate * LOW_SECS;
+	if (low > high - bufsize / 2) low = high - bufsize / 2;
+	setmarks (high, low);
+	if (debug) fprintf (stderr, "stream: in %.2fMB/s out %.2fMB/s, watermarks %i%% %i%%\n",
+			    inrate / (1024*1024), outrate / (1024*1024), 
+			    (int)(100.0*highmark/bufsize), (int)(100.0*lowmark/bufsize));
+}
+
+/* Average output rate in MB/s */
+static double speed ()
+{
+	double secs = now () - begin;
+	return writetotal / (1024*1024 * (secs > 0.001? secs: 0.001));
 }
 
 void sighandler (int sig)
 {
 	fprintf (stderr, "stream: signal %i caught. Terminating!\n", sig);
-	eof = 1; if (inbuf () > 0) empty = 0;
+	__atomic_store_n (&eof, 1, __ATOMIC_RELEASE);
 	signal (sig, SIG_DFL);
 }
 
-int tryread (int fin)
-{
-	int rd; int toread = chunksize; //int inbf;
-	if (full || eof) return 0;
-	/* Use TEMP_FAILURE_RETRY() ? */
-	errno = 0;
-	if (bufsize - readpos < chunksize) toread = bufsize - readpos;
-	rd = read (fin, buffer+readpos, toread);
-	if (rd < 0 || rd == 0) {
-		if (errno == EAGAIN || errno == EINTR) return 0;
-		if (debug) fprintf (stderr, "stream: rp %i wp %i wr %i\n",
-				    readpos, writepos, wrappos);
-		eof = 1; 
-		if (blksize) toread = blksize - (inbuf () % blksize);
-		if (pad && blksize && (inbuf () % blksize)) {
-			if (verbose) fprintf (stderr, "stream: pad with %i bytes\n", toread);
-			memset (buffer+readpos, padbyte, toread);
-			readpos += toread;
+static inline unsigned long long ramfill ()
+{
+	return __atomic_load_n (&ramin, __ATOMIC_ACQUIRE)
+		- __atomic_load_n (&ramout, __ATOMIC_ACQUIRE);
+}
+
+/* What the reader can't overwrite yet: up to the slowest output */
+static inline unsigned long long ramused ()
+{
+	unsigned long long out = __atomic_load_n (&ramout, __ATOMIC_ACQUIRE), o;
+	unsigned int i;
+
+	for (i = 0; i < ntee; i++) {
+		o = __atomic_load_n (&tees[i].out, __ATOMIC_ACQUIRE);
+		if (o < out) out = o;
+	}
+	return __atomic_load_n (&ramin, __ATOMIC_ACQUIRE) - out;
+}
+
+static inline unsigned long long spillfill ()
+{
+	return __atomic_load_n (&spillin, __ATOMIC_ACQUIRE)
+		- __atomic_load_n (&spillout, __ATOMIC_ACQUIRE);
+}
+
+/* A side waited for the other one for secs: 0 the input, 1 the output */
+void stalled (int side, double secs)
+{
+	int bin; double lim;
+
+	if (side) outstall += secs;
+	else install += secs;
+	for (bin = 0, lim = 0.001; bin < STALL_BINS - 1 && secs >= lim; bin++, lim *= 10);
+	stallhist[side][bin]++;
+}
+
+/* Reader thread: fill the ring from fdin, waiting while it is full. With
+ * a spill file, go on there instead until the writer has emptied it.
+ * Tiers are switched between blocks only, so writes stay whole blocks. */
+void * reader (void * arg)
+{
+	int rd; unsigned int toread, topad; double start;
+	unsigned long long pos;
+	char spilling = 0;
+	struct pollfd pfd;
+
+	pfd.fd = fdin; pfd.events = POLLIN;
+	while (!__atomic_load_n (&eof, __ATOMIC_ACQUIRE)) {
+		toread = chunksize - readtotal % chunksize;
+		/* While the input keeps us waiting, the writer may empty the
+		 * spill file */
+		while (spilling && toread == chunksize && spillfill () 
+		       && !__atomic_load_n (&eof, __ATOMIC_ACQUIRE) 
+		       && !poll (&pfd, 1, RING_POLL / 1000));
+		if (spilling && !spillfill () && toread == chunksize) {
+			/* The writer caught up, the ring is empty as well */
+			spillstop = readtotal;
+			__atomic_store_n (&unspills, unspills + 1, __ATOMIC_RELEASE);
+			spilling = 0;
+			if (debug) fprintf (stderr, "stream: spill drained at %Li\n", readtotal);
+		}
+		if (!spilling && bufsize - ramused () < toread && spill 
+		    && toread == chunksize && spillsize - spillfill () >= chunksize) {
+			spillstart = readtotal;
+			__atomic_store_n (&spills, spills + 1, __ATOMIC_RELEASE);
+			spilling = 1;
+			if (debug) fprintf (stderr, "stream: spill from %Li\n", readtotal);
+		}
+		if (spilling? spillsize - spillfill () < toread: bufsize - ramused () < toread) {
+			start = now (); wasfull++;
+			while ((spilling? spillsize - spillfill () < toread: bufsize - ramused () < toread)
+			       && !__atomic_load_n (&eof, __ATOMIC_ACQUIRE))
+				usleep (RING_POLL);
+			stalled (0, now () - start);
+			continue;
+		}
+		if (spilling)
+			rd = read (fdin, spill + spillin % spillsize, toread);
+		else {
+			pos = ramin % bufsize;
+			if (!mirrored && bufsize - pos < toread) toread = bufsize - pos;
+			rd = read (fdin, buffer + pos, toread);
+		}
+		if (rd < 0 && errno == EINTR) continue;
+		if (rd <= 0) {
+			if (rd < 0) perror ("stream: read");
+			else if (verbose) fprintf (stderr, "stream: EOF on input\n");
+			break;
+		}
+		/* The tier first: the writer goes by readtotal */
+		if (spilling) {
+			__atomic_store_n (&spillin, spillin + rd, __ATOMIC_RELEASE);
+			if (spillfill () > maxspill) maxspill = spillfill ();
+		} else {
+			__atomic_store_n (&ramin, ramin + rd, __ATOMIC_RELEASE);
+			if (ramused () > maxram) maxram = ramused ();
+		}
+		__atomic_store_n (&readtotal, readtotal + rd, __ATOMIC_RELEASE);
+	}
+	if (pad && blksize && readtotal % blksize) {
+		topad = blksize - readtotal % blksize;
+		if (verbose) fprintf (stderr, "stream: pad with %i bytes\n", topad);
+		while ((spilling? spillsize - spillfill () < topad: bufsize - ramused () < topad)
+		       && !__atomic_load_n (&eof, __ATOMIC_ACQUIRE))
+			usleep (RING_POLL);
+		if (spilling) {
+			memset (spill + spillin % spillsize, padbyte, topad);
+			__atomic_store_n (&spillin, spillin + topad, __ATOMIC_RELEASE);
+		} else {
+			for (pos = ramin; pos < ramin + topad; pos++)
+				buffer[pos % bufsize] = padbyte;
+			__atomic_store_n (&ramin, ramin + topad, __ATOMIC_RELEASE);
+		}
+		__atomic_store_n (&readtotal, readtotal + topad, __ATOMIC_RELEASE);
+	}
+	if (debug) fprintf (stderr, "stream: reader done, rt %Li wt %Li\n", 
+			    readtotal, writetotal);
+	if (verbose) fprintf (stderr, "stream: buffer contains %Li bytes!\n", inbuf ());
+	__atomic_store_n (&eof, 1, __ATOMIC_RELEASE);
+	return arg;
+}
+
+/* Writer (the main thread): drain the ring to fdout until the reader is
+ * done. Once below the low watermark, it waits until the buffer fills up
+ * to the high one, so the tape streams for longer when it writes.
+ * Spilled data are taken from the spill file in turn. */
+void writer (int fout)
+{
+	int wr; int ctr = 0; int done; double start;
+	unsigned int towrite, writesize = writeblocks * chunksize;
+	unsigned char * src;
+	unsigned long long inbf, avail, pos;
+	char streaming = 0, spilled = 0;
+	unsigned int cycles = 0;
+
+	while (1) {
+		/* The reader sets eof after its last readtotal update */
+		done = __atomic_load_n (&eof, __ATOMIC_ACQUIRE);
+		inbf = inbuf ();
+		if (!inbf && done) break;
+		if (inbf < (streaming? lowmark: highmark) && !done) {
+			if (streaming && debug) 
+				fprintf (stderr, "stream: output stops at %Li bytes\n", inbf);
+			streaming = 0;
+			start = now (); wasempty++;
+			while (inbuf () < highmark 
+			       && !__atomic_load_n (&eof, __ATOMIC_ACQUIRE)) {
+				usleep (RING_POLL);
+				tune ();
+			}
+			stalled (1, now () - start);
+			continue;
+		}
+		if (!streaming) { streaming = 1; starts++; }
+		/* Follow the reader from tier to tier */
+		if (!spilled && __atomic_load_n (&spills, __ATOMIC_ACQUIRE) > cycles 
+		    && writetotal == spillstart)
+			spilled = 1;
+		if (spilled && __atomic_load_n (&unspills, __ATOMIC_ACQUIRE) > cycles 
+		    && writetotal == spillstop) {
+			spilled = 0; cycles++;
+		}
+		avail = spilled? spillfill (): ramfill ();
+		if (!avail) { usleep (RING_POLL); continue; }
+		/* Whole blocks (chunks), but for the rest at EOF */
+		towrite = avail > writesize? writesize: avail;
+		if (towrite > chunksize) towrite -= towrite % chunksize;
+		if (spilled)
+			src = spill + spillout % spillsize;
+		else {
+			pos = ramout % bufsize;
+			src = buffer + pos;
+			if (!mirrored && towrite > bufsize - pos) {
+				memcpy (staging, src, bufsize - pos);
+				memcpy (staging + bufsize - pos, buffer, towrite - (bufsize - pos));
+				src = staging;
+			}
+		}
+		start = now ();
+		wr = write (fout, src, towrite);
+		writetime += now () - start;
+		if (wr < 0 && errno == EINTR) continue;
+		if (wr <= 0) {
+			if (wr < 0) perror ("stream: write");
+			else if (verbose) fprintf (stderr, "stream: EOF on output!\n");
+			exit (3);
+		}
+		if (spilled)
+			__atomic_store_n (&spillout, spillout + wr, __ATOMIC_RELEASE);
+		else
+			__atomic_store_n (&ramout, ramout + wr, __ATOMIC_RELEASE);
+		__atomic_store_n (&writetotal, writetotal + wr, __ATOMIC_RELEASE);
+		tune ();
+		if (reportlevel && !(ctr++ % 128)) 
+			fprintf (stderr, "stream: buffer %2Li%% %9Li %11Li %11Li %6.3fMB/s "
+				 "stall in %5.1fs out %5.1fs spill %9Li\r",
+				 100*ramfill() / bufsize, inbuf (), readtotal, writetotal, 
+				 speed (), install, outstall, spillfill ());
+	}
+}
+
+/* Writer thread of a further output: as writer(), from the RAM ring only */
+void * teewriter (void * arg)
+{
+	struct tee * t = arg;
+	int wr; int done; double start;
+	unsigned int towrite, writesize = writeblocks * chunksize;
+	unsigned char * src;
+	unsigned long long avail, pos;
+	char streaming = 0;
+
+	while (1) {
+		done = __atomic_load_n (&eof, __ATOMIC_ACQUIRE);
+		avail = __atomic_load_n (&ramin, __ATOMIC_ACQUIRE) - t->out;
+		if (!avail && done) break;
+		if (avail < (streaming? lowmark: highmark) && !done) {
+			streaming = 0;
+			start = now (); t->empty++;
+			while (__atomic_load_n (&ramin, __ATOMIC_ACQUIRE) - t->out < highmark 
+			       && !__atomic_load_n (&eof, __ATOMIC_ACQUIRE))
+				usleep (RING_POLL);
+			t->stall += now () - start;
+			continue;
+		}
+		if (!streaming) { streaming = 1; t->starts++; }
+		towrite = avail > writesize? writesize: avail;
+		if (towrite > chunksize) towrite -= towrite % chunksize;
+		pos = t->out % bufsize;
+		src = buffer + pos;
+		if (!mirrored && towrite > bufsize - pos) {
+			memcpy (t->staging, src, bufsize - pos);
+			memcpy (t->staging + bufsize - pos, buffer, towrite - (bufsize - pos));
+			src = t->staging;
+		}
+		start = now ();
+		wr = write (t->fd, src, towrite);
+		t->writetime += now () - start;
+		if (wr < 0 && errno == EINTR) continue;
+		if (wr <= 0) {
+			if (wr < 0) perror ("stream: write");
+			else if (verbose) fprintf (stderr, "stream: EOF on output %s!\n", t->name);
+			exit (3);
+		}
+		__atomic_store_n (&t->out, t->out + wr, __ATOMIC_RELEASE);
+	}
+	return arg;
+}
+
+/* Copy in and out of the RAM ring at a position, across its end */
+void ringput (unsigned long long at, const unsigned char * data, unsigned int len)
+{
+	unsigned int pos = at % bufsize, first = len < bufsize - pos? len: bufsize - pos;
+	memcpy (buffer + pos, data, first);
+	memcpy (buffer, data + first, len - first);
+}
+
+void ringget (unsigned long long at, unsigned char * data, unsigned int len)
+{
+	unsigned int pos = at % bufsize, first = len < bufsize - pos? len: bufsize - pos;
+	memcpy (data, buffer + pos, first);
+	memcpy (data + first, buffer, len - first);
+}
+
+/* -M reader thread: take a chunk from each input that has data, in turn,
+ * and put it in the ring as a record */
+void * muxreader (void * arg)
+{
+	struct pollfd pfd[MAX_MUX];
+	unsigned char * rec = malloc (MUXHDR + chunksize);
+	unsigned int i, left = nmux, topad; int rd;
+	double start;
+
+	for (i = 0; i < nmux; i++) {
+		pfd[i].fd = muxfd[i]; pfd[i].events = POLLIN;
+	}
+	while (left && !__atomic_load_n (&eof, __ATOMIC_ACQUIRE)) {
+		if (poll (pfd, nmux, RING_POLL / 1000) <= 0) continue;
+		for (i = 0; i < nmux; i++) {
+			if (pfd[i].fd < 0 || !pfd[i].revents) continue;
+			if (bufsize - ramused () < MUXHDR + chunksize) {
+				start = now (); wasfull++;
+				while (bufsize - ramused () < MUXHDR + chunksize
+				       && !__atomic_load_n (&eof, __ATOMIC_ACQUIRE))
+					usleep (RING_POLL);
+				stalled (0, now () - start);
+				if (__atomic_load_n (&eof, __ATOMIC_ACQUIRE)) break;
+			}
+			rd = read (pfd[i].fd, rec + MUXHDR, chunksize);
+			if (rd < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+			if (rd <= 0) {
+				if (rd < 0) perror ("stream: read");
+				else if (verbose) fprintf (stderr, "stream: EOF on input %i\n", i);
+				rd = 0;
+				close (pfd[i].fd);
+				pfd[i].fd = -1; left--;
+			}
+			rec[0] = 'M'; rec[1] = 'X';
+			rec[2] = i >> 8; rec[3] = i;
+			rec[4] = rd >> 24; rec[5] = rd >> 16; rec[6] = rd >> 8; rec[7] = rd;
+			ringput (ramin, rec, MUXHDR + rd);
+			muxtotal[i] += rd;
+			__atomic_store_n (&ramin, ramin + MUXHDR + rd, __ATOMIC_RELEASE);
+			__atomic_store_n (&readtotal, readtotal + MUXHDR + rd, __ATOMIC_RELEASE);
+			if (ramused () > maxram) maxram = ramused ();
+		}
+	}
+	if (pad && blksize && readtotal % blksize) {
+		topad = blksize - readtotal % blksize;
+		if (verbose) fprintf (stderr, "stream: pad with %i bytes\n", topad);
+		while (bufsize - ramused () < topad && !__atomic_load_n (&eof, __ATOMIC_ACQUIRE))
+			usleep (RING_POLL);
+		memset (rec, padbyte, topad < MUXHDR + chunksize? topad: MUXHDR + chunksize);
+		ringput (ramin, rec, topad);
+		__atomic_store_n (&ramin, ramin + topad, __ATOMIC_RELEASE);
+		__atomic_store_n (&readtotal, readtotal + topad, __ATOMIC_RELEASE);
+	}
+	free (rec);
+	__atomic_store_n (&eof, 1, __ATOMIC_RELEASE);
+	return arg;
+}
+
+/* -D: wait for len bytes in the ring; false if they won't come */
+int waitdata (unsigned int len)
+{
+	double start;
+
+	if (ramfill () >= len) return 1;
+	start = now (); wasempty++;
+	while (ramfill () < len && !__atomic_load_n (&eof, __ATOMIC_ACQUIRE))
+		usleep (RING_POLL);
+	stalled (1, now () - start);
+	return ramfill () >= len;
+}
+
+/* -D writer (the main thread): split the records from the ring to the
+ * outputs. Whatever follows the end of the last input is padding. */
+void demuxwriter ()
+{
+	unsigned char hdr[MUXHDR];
+	unsigned int id, len, n, left = nmux, pos; int wr;
+
+	while (waitdata (MUXHDR)) {
+		ringget (ramout, hdr, MUXHDR);
+		id  = (hdr[2] << 8) | hdr[3];
+		len = (hdr[4] << 24) | (hdr[5] << 16) | (hdr[6] << 8) | hdr[7];
+		if (hdr[0] != 'M' || hdr[1] != 'X' || id >= nmux || muxfd[id] < 0) {
+			if (!left) break;
+			fprintf (stderr, "stream: bad mux record at %Li!\n", writetotal);
+			exit (3);
+		}
+		__atomic_store_n (&ramout, ramout + MUXHDR, __ATOMIC_RELEASE);
+		__atomic_store_n (&writetotal, writetotal + MUXHDR, __ATOMIC_RELEASE);
+		if (!len) {
+			if (verbose) fprintf (stderr, "stream: end of output %i\n", id);
+			close (muxfd[id]);
+			muxfd[id] = -1; left--;
+			continue;
+		}
+		while (len) {
+			if (!waitdata (1)) {
+				fprintf (stderr, "stream: input ends in a mux record!\n");
+				exit (3);
+			}
+			pos = ramout % bufsize;
+			n = ramfill () < len? ramfill (): len;
+			if (n > chunksize) n = chunksize;
+			if (!mirrored && n > bufsize - pos) n = bufsize - pos;
+			wr = write (muxfd[id], buffer + pos, n);
+			if (wr < 0 && errno == EINTR) continue;
+			if (wr <= 0) {
+				perror ("stream: write");
+				exit (3);
+			}
+			muxtotal[id] += wr; len -= wr;
+			__atomic_store_n (&ramout, ramout + wr, __ATOMIC_RELEASE);
+			__atomic_store_n (&writetotal, writetotal + wr, __ATOMIC_RELEASE);
+		}
+	}
+	if (left) fprintf (stderr, "stream: %i outputs not ended!\n", left);
+}
+
+/* Start a reader or writer thread; signals are left to the main thread */
+pthread_t startthread (void * (*fn) (void *), void * arg)
+{
+	pthread_t thread;
+	sigset_t sigs, oldsigs;
+
+	sigemptyset (&sigs);
+	sigaddset (&sigs, SIGTERM); sigaddset (&sigs, SIGINT);
+	sigaddset (&sigs, SIGQUIT); sigaddset (&sigs, SIGHUP);
+	pthread_sigmask (SIG_BLOCK, &sigs, &oldsigs);
+	if (pthread_create (&thread, 0, fn, arg)) {
+		fprintf (stderr, "stream: can't start thread!\n");
+		exit (2);
+	}
+	pthread_sigmask (SIG_SETMASK, &oldsigs, 0);
+	return thread;
+}
+
+/* -T: open a file, or connect to a unix socket if given as unix:path */
+int opentelemetry (const char * name)
+{
+	struct sockaddr_un addr;
+	int fd, err;
+
+	if (strncmp (name, "unix:", 5))
+		return open (name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	telsock = 1;
+	memset (&addr, 0, sizeof (addr));
+	addr.sun_family = AF_UNIX;
+	strncpy (addr.sun_path, name + 5, sizeof (addr.sun_path) - 1);
+	fd = socket (AF_UNIX, SOCK_STREAM, 0);
+	if (fd >= 0 && connect (fd, (struct sockaddr *) &addr, sizeof (addr))) {
+		err = errno;
+		close (fd);
+		/* the listener may take datagrams */
+		fd = err == EPROTOTYPE? socket (AF_UNIX, SOCK_DGRAM, 0): -1;
+		if (fd >= 0 && connect (fd, (struct sockaddr *) &addr, sizeof (addr))) {
+			close (fd);
+			fd = -1;
 		}
-		if (inbuf () > 0) empty = 0;
-		if (rd < 0) perror ("stream: read");
-		else if (verbose) fprintf (stderr, "stream: EOF on input\n");
-		if (verbose) fprintf (stderr, "stream: buffer contains %i bytes!\n", inbuf ());
-		return 0; 
-	}
-	readpos += rd; readtotal += rd;
-	if (inbuf () >= chunksize) empty = 0;
-	if (bufsize <= readpos) {
-		if (wrappos) fprintf (stderr, "\nstream: Oops! Wraparound!\n");
-		wrappos = readpos;
-		readpos = 0;
-	}
-	if (bufsize - inbuf () <= chunksize) full = 1;
-	return rd;
-}
-
-int trywrite (int fout)
-{
-	int wr; int inbf; int towrite;
-	if (empty) return 0;
-	inbf = inbuf ();
-	towrite = inbf > chunksize? chunksize: inbf;
-	if (towrite < blksize && !eof) return 0;
-	if (towrite < blksize && pad) towrite = blksize;
-	/* Oops: this may eventually produce blocks with the wrong size */
-	if (wrappos && towrite + writepos > wrappos) towrite = wrappos - writepos;
-	errno = 0;
-	wr = write (fout, buffer+writepos, towrite);
-	if (wr < 0 || wr == 0) {
-		if (errno == EAGAIN || errno == EINTR) return 0;
-		eof = 1;
-		if (wr < 0) perror ("stream: write");
-		else if (verbose) fprintf (stderr, "stream: EOF on output!\n");
-		exit (3);
-		//return 0;
-	}
-	writepos += wr; writetotal += wr;
-	if (wrappos && writepos >= wrappos) {
-		writepos = 0;
-		wrappos = 0;
-	}
-	if (inbuf () <= 0) empty = 1;
-	if (inbuf () < chunksize && !eof) empty = 1;
-	if (bufsize - inbuf () > chunksize) full = 0;
-	return wr;
+		if (fd < 0) errno = err;
+	}
+	return fd;
+}
+
+/* Send a line of telemetry; give up on it if the other end goes away */
+void telemsg (const char * fmt, ...)
+{
+	char msg[1024];
+	va_list ap;
+	int len;
+
+	if (telfd < 0) return;
+	va_start (ap, fmt);
+	len = vsnprintf (msg, sizeof (msg), fmt, ap);
+	va_end (ap);
+	if (len >= (int) sizeof (msg)) len = sizeof (msg) - 1;
+	if ((telsock? send (telfd, msg, len, MSG_NOSIGNAL): write (telfd, msg, len)) != len) {
+		perror ("stream: telemetry");
+		close (telfd);
+		telfd = -1;
+	}
+}
+
+/* -T thread: a sample every telinterval. Rates are in bytes/s over the
+ * interval, empty and full count the events in it, the stall times are
+ * totals of the stalls that are over. */
+void * telemetry (void * arg)
+{
+	double t, last = now (), next = last + telinterval;
+	unsigned long long rt, wt, lastrt = 0, lastwt = 0, fill;
+	unsigned int empty, full, lastempty = 0, lastfull = 0;
+
+	while (!__atomic_load_n (&finished, __ATOMIC_ACQUIRE)) {
+		if (now () < next) {
+			usleep (RING_POLL);
+			continue;
+		}
+		t = now (); next += telinterval;
+		rt = __atomic_load_n (&readtotal, __ATOMIC_ACQUIRE);
+		wt = __atomic_load_n (&writetotal, __ATOMIC_ACQUIRE);
+		empty = __atomic_load_n (&wasempty, __ATOMIC_RELAXED);
+		full  = __atomic_load_n (&wasfull , __ATOMIC_RELAXED);
+		fill = ramused ();
+		fillhist[fill * FILL_BINS / bufsize < FILL_BINS? fill * FILL_BINS / bufsize: FILL_BINS - 1]++;
+		telemsg ("{\"t\":%.3f,\"fill\":%Li,\"fillpct\":%.1f,\"spill\":%Li,\"buffered\":%Li,"
+			 "\"read\":%Li,\"written\":%Li,\"inrate\":%.0f,\"outrate\":%.0f,"
+			 "\"empty\":%i,\"full\":%i,\"install\":%.3f,\"outstall\":%.3f}\n",
+			 t - begin, fill, 100.0 * fill / bufsize, spillfill (), rt - wt, rt, wt,
+			 (rt - lastrt) / (t - last), (wt - lastwt) / (t - last),
+			 empty - lastempty, full - lastfull, install, outstall);
+		last = t; lastrt = rt; lastwt = wt;
+		lastempty = empty; lastfull = full;
+	}
+	return arg;
+}
+
+/* Print a histogram as a JSON array */
+char * histjson (char * buf, const unsigned int * hist, int bins)
+{
+	int i, len = 0;
+
+	for (i = 0; i < bins; i++)
+		len += sprintf (buf + len, "%c%u", i? ',': '[', hist[i]);
+	strcpy (buf + len, "]");
+	return buf;
+}
+
+/* -T: stop sampling and send the summary */
+void endtelemetry (pthread_t thread)
+{
+	char fill[12*FILL_BINS], in[12*STALL_BINS], out[12*STALL_BINS];
+
+	if (!telname) return;
+	__atomic_store_n (&finished, 1, __ATOMIC_RELEASE);
+	pthread_join (thread, 0);
+	telemsg ("{\"summary\":{\"secs\":%.3f,\"read\":%Li,\"written\":%Li,\"speed\":%.3f,"
+		 "\"bufsize\":%i,\"highmark\":%i,\"lowmark\":%i,\"starts\":%i,"
+		 "\"empty\":%i,\"full\":%i,\"install\":%.3f,\"outstall\":%.3f,"
+		 "\"maxram\":%Li,\"maxspill\":%Li,\"spills\":%i,"
+		 "\"fillhist\":%s,\"stallbounds\":[0.001,0.01,0.1,1,10],"
+		 "\"installhist\":%s,\"outstallhist\":%s}}\n",
+		 now () - begin, readtotal, writetotal, speed (),
+		 bufsize, highmark, lowmark, starts, wasempty, wasfull, install, outstall,
+		 maxram, maxspill, spills, histjson (fill, fillhist, FILL_BINS),
+		 histjson (in, stallhist[0], STALL_BINS), histjson (out, stallhist[1], STALL_BINS));
+	if (telfd >= 0) close (telfd);
+}
+
+/* -Z reader thread: splice the input into the pipe, and close it at EOF */
+void * splicereader (void * arg)
+{
+	ssize_t n; unsigned int topad; unsigned char * padbuf;
+
+	while (!__atomic_load_n (&eof, __ATOMIC_ACQUIRE)) {
+		n = splice (fdin, 0, splicepipe[1], 0, pipesize, SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) {
+			if (n < 0) perror ("stream: splice from input");
+			else if (verbose) fprintf (stderr, "stream: EOF on input\n");
+			break;
+		}
+		__atomic_store_n (&readtotal, readtotal + n, __ATOMIC_RELEASE);
+	}
+	if (pad && blksize && readtotal % blksize) {
+		topad = blksize - readtotal % blksize;
+		if (verbose) fprintf (stderr, "stream: pad with %i bytes\n", topad);
+		padbuf = malloc (topad);
+		memset (padbuf, padbyte, topad);
+		if (write (splicepipe[1], padbuf, topad) == topad)
+			__atomic_store_n (&readtotal, readtotal + topad, __ATOMIC_RELEASE);
+		free (padbuf);
+	}
+	close (splicepipe[1]);
+	__atomic_store_n (&eof, 1, __ATOMIC_RELEASE);
+	return arg;
+}
+
+/* -Z writer: splice from the pipe to the output until the reader closes
+ * it; after a signal, only what is in the pipe. An output that can't be
+ * spliced to after all is written from a copy. */
+void splicewriter (int fout)
+{
+	ssize_t n; int ctr = 0; 
+	char copyout = 0; int flags = SPLICE_F_MOVE | SPLICE_F_MORE;
+
+	while (1) {
+		if (copyout) {
+			n = read (splicepipe[0], buffer, pipesize);
+			if (n > 0 && write (fout, buffer, n) != n) n = -1;
+		} else
+			n = splice (splicepipe[0], 0, fout, 0, pipesize, flags);
+		if (n == 0) break;
+		if (n < 0 && errno == EINVAL && !writetotal && !copyout) {
+			if (verbose) fprintf (stderr, "stream: can't splice to output, copying\n");
+			copyout = 1;
+			continue;
+		}
+		if (n < 0 && errno == EINTR) {
+			if (__atomic_load_n (&eof, __ATOMIC_ACQUIRE)) {
+				fcntl (splicepipe[0], F_SETFL, O_NONBLOCK);
+				flags |= SPLICE_F_NONBLOCK;
+			}
+			continue;
+		}
+		if (n < 0 && errno == EAGAIN) break;
+		if (n < 0) {
+			perror ("stream: splice to output");
+			exit (3);
+		}
+		__atomic_store_n (&writetotal, writetotal + n, __ATOMIC_RELEASE);
+		if (reportlevel && !(ctr++ % 128)) 
+			fprintf (stderr, "stream: pipe %2Li%% %9Li %11Li %11Li %6.3fMB/s \r",
+				 100*inbuf() / pipesize, inbuf (), readtotal, writetotal, speed ());
+	}
+}
+
+/* -Z: move the data through a kernel pipe by splice(), so they are not
+ * copied to user space. Pipes, files and sockets can do this.
+ * Returns 0 if it can't be used, before any data were moved. */
+int splicepass ()
+{
+	struct stat st; ssize_t n;
+
+	if (fstat (fdin, &st) || !(S_ISFIFO (st.st_mode) || S_ISREG (st.st_mode) || S_ISSOCK (st.st_mode))
+	    || fstat (fdout, &st) || !(S_ISFIFO (st.st_mode) || S_ISREG (st.st_mode) || S_ISSOCK (st.st_mode))
+	    || pipe (splicepipe))
+		return 0;
+	/* As much of the buffer size as we may have in a pipe */
+	for (pipesize = bufsize; pipesize > getpagesize (); pipesize /= 2)
+		if (fcntl (splicepipe[1], F_SETPIPE_SZ, pipesize) >= 0) break;
+	pipesize = fcntl (splicepipe[1], F_GETPIPE_SZ);
+	buffer = malloc (pipesize);
+	/* The first splice tells whether the input can do it */
+	do n = splice (fdin, 0, splicepipe[1], 0, pipesize, SPLICE_F_MOVE);
+	while (n < 0 && errno == EINTR && !eof);
+	if (!buffer || (n < 0 && (errno == EINVAL || errno == ENOSYS))) {
+		close (splicepipe[0]); close (splicepipe[1]);
+		free (buffer);
+		return 0;
+	}
+	if (debug) fprintf (stderr, "stream: splicing through a pipe of %i bytes\n", pipesize);
+	if (n > 0) readtotal = n;
+	else eof = 1;
+
+	startthread (splicereader, 0);
+	splicewriter (fdout);
+	return 1;
 }
 
 
 int main (int argc, char *argv[])
 {
-	int rd, wr; int ready; int ctr = 0; int lastempty = 0;
-	int wasempty = 0; time_t start = time (0);
-	//time_t clk = clock ();
-	struct timeval timeout;
-	fd_set fdsin, fdsout, fdsexc;
+	unsigned int ring, i;
+	struct sigaction sa;
+	pthread_t telthread = 0;
 	
 	parseargs (argc, argv);
+	begin = now ();
+	if (telname && (telfd = opentelemetry (telname)) < 0) {
+		perror ("stream: open telemetry");
+		exit (2);
+	}
 	
 	if (blksize) chunksize = blksize;
 	else chunksize = getpagesize ();
 	
-	bufsize -= bufsize % chunksize;
-	buffer = malloc (bufsize);
-	if (!buffer) { 
+	/* Graceful kill: handled by the writer, the reader may be blocked 
+	 * in read() for a long time. No SA_RESTART, so that a writer waiting
+	 * in splice() for data gets out. */
+	memset (&sa, 0, sizeof (sa));
+	sa.sa_handler = sighandler;
+	sigaction (SIGTERM, &sa, 0);
+	sigaction (SIGINT , &sa, 0);
+	sigaction (SIGQUIT, &sa, 0);
+	sigaction (SIGHUP , &sa, 0);
+	
+	if (bufsize < 2 * chunksize) {
+		fprintf (stderr, "stream: buffer must hold two blocks at least!\n");
+		exit (1);
+	}
+	/* Whole chunks, and whole pages if we can, for mirrormap() */
+	ring = chunksize;
+	while (ring % getpagesize () && ring <= bufsize / 2) ring += chunksize;
+	if (ring % getpagesize ()) ring = chunksize;
+	bufsize -= bufsize % ring;
+	if (mux && bufsize < 2 * chunksize + 2 * MUXHDR) {
+		fprintf (stderr, "stream: buffer too small to mux!\n");
+		exit (1);
+	}
+	if (telname) telthread = startthread (telemetry, 0);
+	
+	if (zerocopy && splicepass ()) {
+		endtelemetry (telthread);
+		if (reportlevel) fprintf (stderr, "\n");
+		if (verbose) fprintf (stderr, "stream: read %Li bytes, wrote %Li\n"
+				      "stream: spliced through a %ik pipe, avg. speed %6.3fMB/s\n",
+				      readtotal, writetotal, pipesize/1024, speed ());
+		return 0;
+	}
+	if (zerocopy && verbose) fprintf (stderr, "stream: can't splice, buffering\n");
+	
+	if (writeblocks * chunksize > bufsize / 2) writeblocks = bufsize / 2 / chunksize;
+	if (!writeblocks) writeblocks = 1;
+	setmarks ((unsigned long long) bufsize * highpct / 100, 
+		  (unsigned long long) bufsize * lowpct / 100);
+	if (!(bufsize % getpagesize ()) && (buffer = mirrormap (bufsize)))
+		mirrored = 1;
+	else {
+		buffer = malloc (bufsize);
+		staging = malloc (writeblocks * chunksize);
+	}
+	if (!buffer || (!mirrored && !staging)) { 
 		fprintf (stderr, "stream: buffer malloc() failed!\n"); 
 		exit (2); 
 	}
-	/* Set non-blocking mode */
-	fcntl (fdin,  F_SETFL, O_NONBLOCK);
-	fcntl (fdout, F_SETFL, O_NONBLOCK);
-	/* Graceful kill */
-	signal (SIGTERM, sighandler);
-	signal (SIGINT , sighandler);
-	signal (SIGQUIT, sighandler);
-	signal (SIGHUP , sighandler);
-	/* Main loop */
-	while (!eof || !empty) {
-		rd = tryread  (fdin);
-		wr = trywrite (fdout);
-		if (rd && !eof && inbuf() < 1*bufsize / 3)
-			rd += tryread (fdin);
-		if (wr && !empty && inbuf() > 2*bufsize / 3)
-			wr += trywrite (fdout);
-		if (rd && !eof && inbuf() < 1*bufsize / 10)
-			rd += tryread (fdin);
-		if (wr && !empty && inbuf() > 9*bufsize / 10)
-			wr += trywrite (fdout);
-		if (reportlevel && !(ctr++ % 128)) 
-			fprintf (stderr, "stream: buffer %2i%% %9i %11Li %11Li %6.3fMB/s \r",
-				 100*inbuf() / bufsize, inbuf (), readtotal, 
-				 writetotal, writetotal/(1+1024*1024*difftime (time(0), start)));
-#if 1
-		if (wrappos + readpos - writepos != readtotal - writetotal && !eof) {
-			fprintf (stderr, "\nstream: Oops!\n");
-			abort ();
+	if (debug) fprintf (stderr, "stream: %s buffer of %i bytes\n", 
+			    mirrored? "mirrored": "plain", bufsize);
+	if (spillname) {
+		/* Mapped as the buffer is, in whole pages and chunks */
+		for (ring = chunksize; ring % getpagesize (); ring += chunksize);
+		spillsize -= spillsize % ring;
+		if (!spillsize || !(spill = spillmap (spillname, spillsize))) {
+			perror ("stream: spill file");
+			exit (2);
 		}
-#endif
-		if (inbuf () <= chunksize) lastempty++; else lastempty = 0;
-		if (lastempty == 1) wasempty++;
-		if (rd == 0 && wr == 0) {
-			/* Prepare filedescriptor sets for select() */
-			FD_ZERO (&fdsin ); FD_ZERO (&fdsout); FD_ZERO (&fdsexc);
-			FD_SET (fdin , &fdsin ); FD_SET (fdout, &fdsout);
-			FD_SET (fdin , &fdsexc); FD_SET (fdout, &fdsexc);
-			timeout.tv_usec = 0; timeout.tv_sec = 30;
-			if (debug) fprintf (stderr, "stream: select() (%i %i) ", empty, full);
-			/* There might be three possible reasons for idling:
-			 * - buffer empty and no input 
-			 * - buffer full and no output
-			 * - both no input nor output
-			 */
-			if (full)
-				ready = select (FD_SETSIZE, NULL  , &fdsout, &fdsexc, &timeout);
-			else if (empty)
-				ready = select (FD_SETSIZE, &fdsin, NULL   , &fdsexc, &timeout);
-			else
-				ready = select (FD_SETSIZE, &fdsin, &fdsout, &fdsexc, &timeout);
-			if (debug) fprintf (stderr, "= %i\n", ready);
-			if (!ready)
-				if (verbose) fprintf (stderr, "\nstream: no progress.\n");
+		if (verbose) fprintf (stderr, "   spill to %s, %iM\n", spillname, 
+				      (int)(spillsize/(1024*1024)));
+	}
+	for (i = 0; i < ntee; i++) {
+		if (!mirrored && !(tees[i].staging = malloc (writeblocks * chunksize))) {
+			fprintf (stderr, "stream: buffer malloc() failed!\n");
+			exit (2);
 		}
+		tees[i].thread = startthread (teewriter, tees + i);
 	}
+	if (mux) {
+		startthread (muxreader, 0);
+		writer (fdout);
+	} else if (demux) {
+		startthread (reader, 0);
+		demuxwriter ();
+	} else {
+		startthread (reader, 0);
+		writer (fdout);
+	}
+	
+	for (i = 0; i < ntee; i++)
+		pthread_join (tees[i].thread, 0);
+	endtelemetry (telthread);
+	
 	if (reportlevel) fprintf (stderr, "\n");
-	if (debug) fprintf (stderr, "stream: normal exit (%i %i)\n", empty, eof);
+	if (debug) fprintf (stderr, "stream: normal exit (%Li %i)\n", inbuf (), eof);
 	if (verbose) fprintf (stderr, "stream: read %Li bytes, wrote %Li\n"
-			      "stream: Buf was %i times empty, avg. speed %6.3fMB/s\n",
-			      readtotal, writetotal,
-			      wasempty, writetotal/(1+1024*1024*difftime (time(0), start)));
+			      "stream: Buf was %i times empty, %i times full, avg. speed %6.3fMB/s\n"
+			      "stream: input stalled %.1fs (buffer full), output %.1fs (buffer empty)\n"
+			      "stream: output started %i times, watermarks %i%% %i%%\n"
+			      "stream: at most %Li bytes in RAM, %Li in the spill file (%i times)\n",
+			      readtotal, writetotal, wasempty, wasfull, 
+			      speed (),
+			      install, outstall, starts, 
+			      (int)(100.0*highmark/bufsize), (int)(100.0*lowmark/bufsize),
+			      maxram, maxspill, spills);
+	for (i = 0; verbose && i < nmux; i++)
+		fprintf (stderr, "stream: %s %i: %Li bytes\n", mux? "input": "output", 
+			 i, muxtotal[i]);
+	if (verbose && ntee) fprintf (stderr, "stream: output 0: %Li bytes, %6.3fMB/s while writing\n",
+				      writetotal, writetime > 0? writetotal / (1024*1024 * writetime): 0);
+	for (i = 0; verbose && i < ntee; i++)
+		fprintf (stderr, "stream: output %i (%s): %Li bytes, %6.3fMB/s while writing\n"
+			 "stream:    %i times empty for %.1fs, started %i times\n", 
+			 i + 1, tees[i].name, tees[i].out, 
+			 tees[i].writetime > 0? tees[i].out / (1024*1024 * tees[i].writetime): 0,
+			 tees[i].empty, tees[i].stall, tees[i].starts);
 	return 0;
 }